@@ -0,0 +1,366 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpCompress.cpp
+///
+/// @brief LZ4 compression of kcp datagrams.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <string.h>
+
+#include "KcpCompress.h"
+
+//------------------------------------------------------------------------------
+// LZ4 block format: sequences of a token, literals and a match. The token
+// holds the literal count and the match length minus 4 in a nibble each,
+// 15 meaning more follows in bytes of up to 255. A 2 byte little endian
+// offset leads the match, and the last sequence is literals only: the
+// last 5 bytes are always literals and no match starts in the last 12.
+//------------------------------------------------------------------------------
+enum
+{
+    LZ4_MIN_MATCH = 4,
+    LZ4_LAST_LITERALS = 5,
+    LZ4_MATCH_LIMIT = 12,
+    LZ4_MAX_OFFSET = 65535,
+};
+
+static inline IUINT32 Read32(const unsigned char* p)
+{
+    IUINT32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline IUINT32 Lz4Hash(IUINT32 sequence, int bits)
+{
+    return (sequence * 2654435761U) >> (32 - bits);
+}
+
+// the bytes after a nibble of 15
+static inline unsigned char* Lz4Length(unsigned char* op, int length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+// worst case size of a sequence
+static inline int Lz4Bound(int literals, int match)
+{
+    return 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpCompressor::KcpCompressor(int mtu, const char* dict, int dictSize):
+m_mtu(mtu),
+m_dictSize(0),
+m_ratio(0),
+m_skipped(0),
+m_bytesIn(0),
+m_bytesOut(0),
+m_bypassed(0)
+{
+    if ((dict != NULL) && (dictSize > 0))
+    {
+        m_dictSize = (dictSize > MAX_DICT) ? MAX_DICT : dictSize;
+        dict += dictSize - m_dictSize;
+    }
+
+    m_work = new unsigned char[m_dictSize + m_mtu];
+    m_output = new unsigned char[m_dictSize + m_mtu];
+
+    if (m_dictSize > 0)
+    {
+        memcpy(m_work, dict, m_dictSize);
+        memcpy(m_output, dict, m_dictSize);
+    }
+
+    memset(m_dictHash, 0, sizeof(m_dictHash));
+    for (int i = 0; i + LZ4_MIN_MATCH <= m_dictSize; i++)
+    {
+        m_dictHash[Lz4Hash(Read32(m_work + i), HASH_BITS)] = (IUINT16)i;
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpCompressor::~KcpCompressor()
+{
+    delete [] m_work;
+    delete [] m_output;
+}
+
+//------------------------------------------------------------------------------
+// Compress the datagram at m_work + m_dictSize into 'out', greedy with a
+// single entry hash table and a step growing over incompressible runs.
+// Returns -1 if the block would not fit 'capacity'.
+//------------------------------------------------------------------------------
+int KcpCompressor::Lz4Compress(int size, unsigned char* out, int capacity)
+{
+    const unsigned char* base = m_work;
+    const unsigned char* ip = m_work + m_dictSize;
+    const unsigned char* anchor = ip;
+    const unsigned char* iend = ip + size;
+    const unsigned char* mflimit = iend - LZ4_MATCH_LIMIT;
+    const unsigned char* matchlimit = iend - LZ4_LAST_LITERALS;
+    unsigned char* op = out;
+    unsigned char* oend = out + capacity;
+    int misses = 0;
+
+    memcpy(m_hash, m_dictHash, sizeof(m_hash));
+
+    while (ip < mflimit)
+    {
+        IUINT32 sequence = Read32(ip);
+        IUINT32 h = Lz4Hash(sequence, HASH_BITS);
+        const unsigned char* ref = base + m_hash[h];
+        m_hash[h] = (IUINT16)(ip - base);
+
+        if ((ref >= ip) || (ip - ref > LZ4_MAX_OFFSET) || (Read32(ref) != sequence))
+        {
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1]))
+        {
+            --ip;
+            --ref;
+        }
+
+        const unsigned char* end = ip + LZ4_MIN_MATCH;
+        ref += LZ4_MIN_MATCH;
+        while ((end < matchlimit) && (*end == *ref))
+        {
+            ++end;
+            ++ref;
+        }
+
+        int literals = (int)(ip - anchor);
+        int match = (int)(end - ip) - LZ4_MIN_MATCH;
+        if (Lz4Bound(literals, match) > oend - op)
+        {
+            return -1;
+        }
+
+        unsigned char* token = op++;
+        *token = (unsigned char)(((literals < 15) ? literals : 15) << 4);
+        if (literals >= 15)
+        {
+            op = Lz4Length(op, literals);
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        int offset = (int)(end - ref);
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+
+        *token |= (unsigned char)((match < 15) ? match : 15);
+        if (match >= 15)
+        {
+            op = Lz4Length(op, match);
+        }
+
+        ip = end;
+        anchor = ip;
+
+        // the sequence just behind the match is cheap to remember
+        if (ip < mflimit)
+        {
+            m_hash[Lz4Hash(Read32(ip - 2), HASH_BITS)] = (IUINT16)(ip - 2 - base);
+        }
+    }
+
+    int literals = (int)(iend - anchor);
+    if (1 + literals + literals / 255 + 1 > oend - op)
+    {
+        return -1;
+    }
+
+    *op++ = (unsigned char)(((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15)
+    {
+        op = Lz4Length(op, literals);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return (int)(op - out);
+}
+
+//------------------------------------------------------------------------------
+// Decompress a block to m_output + m_dictSize, checking every length and
+// offset since the packet comes off the wire. Returns -1 if malformed.
+//------------------------------------------------------------------------------
+int KcpCompressor::Lz4Decompress(const unsigned char* in, int size)
+{
+    const unsigned char* ip = in;
+    const unsigned char* iend = in + size;
+    unsigned char* base = m_output;
+    unsigned char* start = m_output + m_dictSize;
+    unsigned char* op = start;
+    unsigned char* oend = start + m_mtu;
+
+    for (;;)
+    {
+        if (ip >= iend)
+        {
+            return -1;
+        }
+
+        int token = *ip++;
+        int length = token >> 4;
+        if (15 == length)
+        {
+            int more;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                more = *ip++;
+                length += more;
+            } while (255 == more);
+        }
+
+        if ((length > iend - ip) || (length > oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((0 == offset) || (offset > op - base))
+        {
+            return -1;
+        }
+
+        length = token & 15;
+        if (15 == length)
+        {
+            int more;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                more = *ip++;
+                length += more;
+            } while (255 == more);
+        }
+        length += LZ4_MIN_MATCH;
+
+        if (length > oend - op)
+        {
+            return -1;
+        }
+
+        // byte by byte, a match may overlap what it produces
+        const unsigned char* ref = op - offset;
+        while (length-- > 0)
+        {
+            *op++ = *ref++;
+        }
+    }
+
+    return (int)(op - start);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpCompressor::Compress(const char* data, int size, char* out)
+{
+    int packet = -1;
+
+    if ((size < 0) || (size > m_mtu))
+    {
+        return -1;
+    }
+
+    m_bytesIn += size;
+
+    if ((m_ratio > BYPASS_RATIO) && (++m_skipped < PROBE_INTERVAL))
+    {
+        ++m_bypassed;
+    }
+    else if (size > 0)
+    {
+        m_skipped = 0;
+        memcpy(m_work + m_dictSize, data, size);
+
+        // only worth it if the flag byte is paid for
+        int n = Lz4Compress(size, (unsigned char*)out + HEADER_SIZE, size - HEADER_SIZE);
+        int ratio = (n < 0) ? 256 : (n + HEADER_SIZE) * 256 / size;
+        m_ratio += (ratio - m_ratio) / (1 << EWMA_SHIFT);
+
+        if (n >= 0)
+        {
+            out[0] = FLAG_LZ4;
+            packet = n + HEADER_SIZE;
+        }
+    }
+
+    if (packet < 0)
+    {
+        out[0] = FLAG_RAW;
+        memcpy(out + HEADER_SIZE, data, size);
+        packet = size + HEADER_SIZE;
+    }
+
+    m_bytesOut += packet;
+    return packet;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpCompressor::Decompress(const char* packet, int size, const char** data)
+{
+    if (size < HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    if (FLAG_RAW == packet[0])
+    {
+        *data = packet + HEADER_SIZE;
+        return size - HEADER_SIZE;
+    }
+
+    if (FLAG_LZ4 == packet[0])
+    {
+        int n = Lz4Decompress((const unsigned char*)packet + HEADER_SIZE, size - HEADER_SIZE);
+        if (n >= 0)
+        {
+            *data = (const char*)m_output + m_dictSize;
+        }
+        return n;
+    }
+
+    return -1;
+}
@@ -0,0 +1,150 @@
+#ifndef __KCP_COMPRESS_H__
+#define __KCP_COMPRESS_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpCompress.h
+///
+/// @brief LZ4 compression of kcp datagrams.
+///
+/// Every datagram gets a one byte header telling whether the rest is an
+/// LZ4 block or the datagram as is. Each datagram is compressed on its
+/// own, so loss and reordering never stall the decoder, and matches may
+/// reach back into a dictionary both ends of the session agree on, which
+/// is what makes small packets of repetitive records compress at all.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ikcp.h"
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpCompressor
+///
+/// Compresses outgoing and decompresses incoming datagrams of one kcp
+/// session. When compression stops paying, datagrams go out as they are
+/// and only every PROBE_INTERVAL-th one is tried, until it pays again.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpCompressor
+{
+public:
+
+    enum
+    {
+        /// flag byte in front of every datagram
+        HEADER_SIZE = 1,
+        /// flag values
+        FLAG_RAW = 0,
+        FLAG_LZ4 = 1,
+        /// largest dictionary, back references are 16 bit
+        MAX_DICT = 32768,
+        /// average compressed size per 256 input bytes above which
+        /// compression is bypassed
+        BYPASS_RATIO = 230,
+        /// datagrams per compression attempt while bypassed
+        PROBE_INTERVAL = 16,
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] mtu - largest datagram to compress or to decompress to
+    /// @param[in] dict - dictionary, the same on both ends, may be NULL
+    /// @param[in] dictSize - dictionary size, only the last MAX_DICT
+    ///            bytes are used
+    ////////////////////////////////////////////////////////////////////////////
+    KcpCompressor(int mtu, const char* dict = NULL, int dictSize = 0);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpCompressor();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Frame a datagram, compressed if it pays
+    /// @param[in] data - datagram
+    /// @param[in] size - datagram size, at most mtu
+    /// @param[out] out - room for size + HEADER_SIZE bytes
+    /// @return packet size, -1 if the datagram is too large
+    ////////////////////////////////////////////////////////////////////////////
+    int Compress(const char* data, int size, char* out);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Unframe a packet of the other end
+    /// @param[in] packet - packet
+    /// @param[in] size - packet size
+    /// @param[out] data - the datagram, inside packet or an internal
+    ///             buffer valid until the next call
+    /// @return datagram size, -1 if the packet is malformed
+    ////////////////////////////////////////////////////////////////////////////
+    int Decompress(const char* packet, int size, const char** data);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of datagram bytes given to Compress
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT64 GetBytesIn() const
+    {
+        return m_bytesIn;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of packet bytes Compress produced
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT64 GetBytesOut() const
+    {
+        return m_bytesOut;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of datagrams sent raw without trying
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetBypassed() const
+    {
+        return m_bypassed;
+    }
+
+private:
+
+    enum
+    {
+        HASH_BITS = 11,
+        HASH_SIZE = 1 << HASH_BITS,
+        /// a new ratio weighs 1/8 in the EWMA
+        EWMA_SHIFT = 3,
+    };
+
+    /// Forbid copy constructor
+    KcpCompressor(const KcpCompressor&);
+    /// Forbid assignment operator
+    KcpCompressor& operator=(const KcpCompressor&);
+
+    int Lz4Compress(int size, unsigned char* out, int capacity);
+    int Lz4Decompress(const unsigned char* in, int size);
+
+    int m_mtu;
+    int m_dictSize;
+
+    /// dictionary followed by the datagram being compressed
+    unsigned char* m_work;
+
+    /// dictionary followed by the datagram being decompressed
+    unsigned char* m_output;
+
+    /// positions in m_work of the last 4 byte sequences per hash
+    IUINT16 m_hash[HASH_SIZE];
+
+    /// m_hash once the dictionary is hashed
+    IUINT16 m_dictHash[HASH_SIZE];
+
+    /// EWMA of the compressed size per 256 input bytes
+    int m_ratio;
+
+    /// datagrams sent raw since the last attempt
+    int m_skipped;
+
+    IUINT64 m_bytesIn;
+    IUINT64 m_bytesOut;
+    IUINT32 m_bypassed;
+};
+
+
+#endif // __KCP_COMPRESS_H__
@@ -0,0 +1,532 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpCrypt.cpp
+///
+/// @brief ChaCha20-Poly1305 (RFC 8439) encryption of kcp datagrams.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "KcpCrypt.h"
+
+static inline IUINT32 Load32(const unsigned char* p)
+{
+    return (IUINT32)p[0] | ((IUINT32)p[1] << 8) |
+        ((IUINT32)p[2] << 16) | ((IUINT32)p[3] << 24);
+}
+
+static inline void Store32(unsigned char* p, IUINT32 v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline void Store64(unsigned char* p, IUINT64 v)
+{
+    Store32(p, (IUINT32)v);
+    Store32(p + 4, (IUINT32)(v >> 32));
+}
+
+static inline IUINT64 Load64(const unsigned char* p)
+{
+    return (IUINT64)Load32(p) | ((IUINT64)Load32(p + 4) << 32);
+}
+
+//------------------------------------------------------------------------------
+// ChaCha20: key, block counter and nonce make the 16 word input state.
+//------------------------------------------------------------------------------
+struct ChaChaState
+{
+    IUINT32 words[16];
+
+    ChaChaState(const IUINT32* key, const unsigned char* nonce)
+    {
+        words[0] = 0x61707865;
+        words[1] = 0x3320646e;
+        words[2] = 0x79622d32;
+        words[3] = 0x6b206574;
+        for (int i = 0; i < 8; i++)
+        {
+            words[4 + i] = key[i];
+        }
+        words[12] = 0;
+        words[13] = Load32(nonce);
+        words[14] = Load32(nonce + 4);
+        words[15] = Load32(nonce + 8);
+    }
+};
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+static void ChaChaBlock(const IUINT32* in, unsigned char* out)
+{
+    IUINT32 x[16];
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        Store32(out + 4 * i, x[i] + in[i]);
+    }
+}
+
+#if defined(__SSE2__)
+
+#define CHACHA_ROTL128(v, n) \
+    _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define CHACHA_QUARTER128(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL128(d, 16); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL128(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL128(d, 8); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL128(b, 7);
+
+//------------------------------------------------------------------------------
+// out = in ^ one key stream block, a state row per register: the column
+// round works on all four columns at once, the diagonal round after
+// rotating rows 1 to 3 so the diagonals line up as columns.
+//------------------------------------------------------------------------------
+static void ChaChaXorBlock(const IUINT32* state, const unsigned char* in, unsigned char* out)
+{
+    const __m128i s0 = _mm_loadu_si128((const __m128i*)(state + 0));
+    const __m128i s1 = _mm_loadu_si128((const __m128i*)(state + 4));
+    const __m128i s2 = _mm_loadu_si128((const __m128i*)(state + 8));
+    const __m128i s3 = _mm_loadu_si128((const __m128i*)(state + 12));
+    __m128i a = s0;
+    __m128i b = s1;
+    __m128i c = s2;
+    __m128i d = s3;
+
+    for (int i = 0; i < 10; i++)
+    {
+        CHACHA_QUARTER128(a, b, c, d);
+        b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+        c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+        d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+        CHACHA_QUARTER128(a, b, c, d);
+        b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+        c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+        d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    // SSE2 implies x86, so the words are already stored little endian
+    const __m128i* src = (const __m128i*)in;
+    __m128i* dst = (__m128i*)out;
+    _mm_storeu_si128(dst + 0, _mm_xor_si128(_mm_loadu_si128(src + 0), _mm_add_epi32(a, s0)));
+    _mm_storeu_si128(dst + 1, _mm_xor_si128(_mm_loadu_si128(src + 1), _mm_add_epi32(b, s1)));
+    _mm_storeu_si128(dst + 2, _mm_xor_si128(_mm_loadu_si128(src + 2), _mm_add_epi32(c, s2)));
+    _mm_storeu_si128(dst + 3, _mm_xor_si128(_mm_loadu_si128(src + 3), _mm_add_epi32(d, s3)));
+}
+
+#else
+
+static void ChaChaXorBlock(const IUINT32* state, const unsigned char* in, unsigned char* out)
+{
+    unsigned char block[64];
+    ChaChaBlock(state, block);
+    for (int i = 0; i < 64; i++)
+    {
+        out[i] = in[i] ^ block[i];
+    }
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// out = in ^ key stream from block 'counter' on, out may equal in.
+//------------------------------------------------------------------------------
+static void ChaChaXor(ChaChaState& state, IUINT32 counter,
+    const unsigned char* in, unsigned char* out, int size)
+{
+    state.words[12] = counter;
+
+    while (size >= 64)
+    {
+        ChaChaXorBlock(state.words, in, out);
+        ++state.words[12];
+        in += 64;
+        out += 64;
+        size -= 64;
+    }
+
+    if (size > 0)
+    {
+        unsigned char block[64];
+        ChaChaBlock(state.words, block);
+        for (int i = 0; i < size; i++)
+        {
+            out[i] = in[i] ^ block[i];
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Poly1305 with 26 bit limbs, only ever fed whole 16 byte blocks since
+// the aead pads its input to them.
+//------------------------------------------------------------------------------
+class Poly1305
+{
+public:
+
+    Poly1305(const unsigned char* key)
+    {
+        m_r[0] = (Load32(key + 0)) & 0x3ffffff;
+        m_r[1] = (Load32(key + 3) >> 2) & 0x3ffff03;
+        m_r[2] = (Load32(key + 6) >> 4) & 0x3ffc0ff;
+        m_r[3] = (Load32(key + 9) >> 6) & 0x3f03fff;
+        m_r[4] = (Load32(key + 12) >> 8) & 0x00fffff;
+
+        for (int i = 0; i < 4; i++)
+        {
+            m_pad[i] = Load32(key + 16 + 4 * i);
+        }
+
+        memset(m_h, 0, sizeof(m_h));
+    }
+
+    void Blocks(const unsigned char* data, int size)
+    {
+        const IUINT32 r0 = m_r[0], r1 = m_r[1], r2 = m_r[2], r3 = m_r[3], r4 = m_r[4];
+        const IUINT32 s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        IUINT32 h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+        for (; size >= 16; data += 16, size -= 16)
+        {
+            h0 += (Load32(data + 0)) & 0x3ffffff;
+            h1 += (Load32(data + 3) >> 2) & 0x3ffffff;
+            h2 += (Load32(data + 6) >> 4) & 0x3ffffff;
+            h3 += (Load32(data + 9) >> 6) & 0x3ffffff;
+            h4 += (Load32(data + 12) >> 8) | (1 << 24);
+
+            IUINT64 d0 = (IUINT64)h0 * r0 + (IUINT64)h1 * s4 + (IUINT64)h2 * s3 + (IUINT64)h3 * s2 + (IUINT64)h4 * s1;
+            IUINT64 d1 = (IUINT64)h0 * r1 + (IUINT64)h1 * r0 + (IUINT64)h2 * s4 + (IUINT64)h3 * s3 + (IUINT64)h4 * s2;
+            IUINT64 d2 = (IUINT64)h0 * r2 + (IUINT64)h1 * r1 + (IUINT64)h2 * r0 + (IUINT64)h3 * s4 + (IUINT64)h4 * s3;
+            IUINT64 d3 = (IUINT64)h0 * r3 + (IUINT64)h1 * r2 + (IUINT64)h2 * r1 + (IUINT64)h3 * r0 + (IUINT64)h4 * s4;
+            IUINT64 d4 = (IUINT64)h0 * r4 + (IUINT64)h1 * r3 + (IUINT64)h2 * r2 + (IUINT64)h3 * r1 + (IUINT64)h4 * r0;
+
+            IUINT32 c = (IUINT32)(d0 >> 26);
+            h0 = (IUINT32)d0 & 0x3ffffff;
+            d1 += c; c = (IUINT32)(d1 >> 26); h1 = (IUINT32)d1 & 0x3ffffff;
+            d2 += c; c = (IUINT32)(d2 >> 26); h2 = (IUINT32)d2 & 0x3ffffff;
+            d3 += c; c = (IUINT32)(d3 >> 26); h3 = (IUINT32)d3 & 0x3ffffff;
+            d4 += c; c = (IUINT32)(d4 >> 26); h4 = (IUINT32)d4 & 0x3ffffff;
+            h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+            h1 += c;
+        }
+
+        m_h[0] = h0; m_h[1] = h1; m_h[2] = h2; m_h[3] = h3; m_h[4] = h4;
+    }
+
+    // data padded with zeros to whole blocks
+    void Padded(const unsigned char* data, int size)
+    {
+        int whole = size & ~15;
+        Blocks(data, whole);
+        if (size > whole)
+        {
+            unsigned char block[16];
+            memset(block, 0, sizeof(block));
+            memcpy(block, data + whole, size - whole);
+            Blocks(block, 16);
+        }
+    }
+
+    void Finish(unsigned char* tag)
+    {
+        IUINT32 h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+        IUINT32 c;
+
+        c = h1 >> 26; h1 &= 0x3ffffff;
+        h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+        h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+        h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        // h - p, taken when it does not go below zero
+        IUINT32 g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+        IUINT32 g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+        IUINT32 g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+        IUINT32 g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+        IUINT32 g4 = h4 + c - (1 << 26);
+
+        IUINT32 mask = (g4 >> 31) - 1;
+        h0 = (h0 & ~mask) | (g0 & mask);
+        h1 = (h1 & ~mask) | (g1 & mask);
+        h2 = (h2 & ~mask) | (g2 & mask);
+        h3 = (h3 & ~mask) | (g3 & mask);
+        h4 = (h4 & ~mask) | (g4 & mask);
+
+        IUINT32 w0 = h0 | (h1 << 26);
+        IUINT32 w1 = (h1 >> 6) | (h2 << 20);
+        IUINT32 w2 = (h2 >> 12) | (h3 << 14);
+        IUINT32 w3 = (h3 >> 18) | (h4 << 8);
+
+        IUINT64 f = (IUINT64)w0 + m_pad[0];
+        Store32(tag + 0, (IUINT32)f);
+        f = (IUINT64)w1 + m_pad[1] + (f >> 32);
+        Store32(tag + 4, (IUINT32)f);
+        f = (IUINT64)w2 + m_pad[2] + (f >> 32);
+        Store32(tag + 8, (IUINT32)f);
+        f = (IUINT64)w3 + m_pad[3] + (f >> 32);
+        Store32(tag + 12, (IUINT32)f);
+    }
+
+private:
+
+    IUINT32 m_r[5];
+    IUINT32 m_h[5];
+    IUINT32 m_pad[4];
+};
+
+//------------------------------------------------------------------------------
+// Tag of a ciphertext without associated data: the counter is already
+// bound through the nonce.
+//------------------------------------------------------------------------------
+static void AeadTag(ChaChaState& state, const unsigned char* data, int size, unsigned char* tag)
+{
+    unsigned char key[64];
+    unsigned char lengths[16];
+
+    state.words[12] = 0;
+    ChaChaBlock(state.words, key);
+
+    Poly1305 mac(key);
+    mac.Padded(data, size);
+    Store64(lengths, 0);
+    Store64(lengths + 8, (IUINT64)size);
+    mac.Blocks(lengths, 16);
+    mac.Finish(tag);
+
+    memset(key, 0, sizeof(key));
+}
+
+static void MakeNonce(unsigned char* nonce, int side, const unsigned char* counter)
+{
+    nonce[0] = (unsigned char)side;
+    nonce[1] = 0;
+    nonce[2] = 0;
+    nonce[3] = 0;
+    memcpy(nonce + 4, counter, 8);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpAead::KcpAead(const unsigned char* key, IUINT32 conv, int side):
+m_conv(conv),
+m_peerKnown(false),
+m_side(side ? 1 : 0),
+m_counter(0),
+m_highest(0),
+m_window(0),
+m_rejected(0)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        m_master[i] = Load32(key + 4 * i);
+    }
+
+    MakeSalt(m_salt);
+    DeriveKey(m_salt, m_sealKey);
+    memset(m_openKey, 0, sizeof(m_openKey));
+    memset(m_peerSalt, 0, sizeof(m_peerSalt));
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpAead::~KcpAead()
+{
+    memset(m_master, 0, sizeof(m_master));
+    memset(m_sealKey, 0, sizeof(m_sealKey));
+    memset(m_openKey, 0, sizeof(m_openKey));
+}
+
+//------------------------------------------------------------------------------
+// Draw a salt from the kernel. It only has to differ between the runs,
+// so where /dev/urandom cannot be read the time, pid and a call count
+// stand in for it.
+//------------------------------------------------------------------------------
+void KcpAead::MakeSalt(unsigned char* salt)
+{
+    static IUINT32 calls = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd >= 0)
+    {
+        ssize_t n = read(fd, salt, SALT_SIZE);
+        close(fd);
+        if (SALT_SIZE == n)
+        {
+            return;
+        }
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    Store32(salt, (IUINT32)tv.tv_sec ^ ((IUINT32)getpid() << 16));
+    Store32(salt + 4, (IUINT32)tv.tv_usec ^ (__sync_fetch_and_add(&calls, 1) << 20));
+}
+
+//------------------------------------------------------------------------------
+// Key of a direction: the first key stream bytes of the master key under
+// the conv and the salt of the sender. Packets never use the master key.
+//------------------------------------------------------------------------------
+void KcpAead::DeriveKey(const unsigned char* salt, IUINT32* key) const
+{
+    unsigned char nonce[12];
+    unsigned char block[64];
+
+    Store32(nonce, m_conv);
+    memcpy(nonce + 4, salt, SALT_SIZE);
+
+    ChaChaState state(m_master, nonce);
+    ChaChaBlock(state.words, block);
+    for (int i = 0; i < 8; i++)
+    {
+        key[i] = Load32(block + 4 * i);
+    }
+
+    memset(block, 0, sizeof(block));
+}
+
+//------------------------------------------------------------------------------
+// Check a counter against the window of the counters opened so far.
+//------------------------------------------------------------------------------
+bool KcpAead::IsReplay(IUINT64 counter) const
+{
+    if (!m_peerKnown || (counter > m_highest))
+    {
+        return false;
+    }
+
+    IUINT64 behind = m_highest - counter;
+    return (behind >= REPLAY_WINDOW) || ((m_window >> behind) & 1);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpAead::Seal(char* data, int size)
+{
+    unsigned char* text = (unsigned char*)data;
+    unsigned char* header = text - HEADER_SIZE;
+    unsigned char nonce[12];
+
+    memcpy(header, m_salt, SALT_SIZE);
+    Store64(header + SALT_SIZE, m_counter++);
+    MakeNonce(nonce, m_side, header + SALT_SIZE);
+
+    ChaChaState state(m_sealKey, nonce);
+    ChaChaXor(state, 1, text, text, size);
+    AeadTag(state, text, size, text + size);
+
+    return size + OVERHEAD;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpAead::Open(const char* packet, int size, char* out)
+{
+    const unsigned char* header = (const unsigned char*)packet;
+    const unsigned char* text = header + HEADER_SIZE;
+    unsigned char nonce[12];
+    unsigned char tag[TAG_SIZE];
+    IUINT32 key[8];
+
+    if ((size < OVERHEAD) ||
+        (m_peerKnown && (0 != memcmp(header, m_peerSalt, SALT_SIZE))))
+    {
+        ++m_rejected;
+        return -1;
+    }
+
+    IUINT64 counter = Load64(header + SALT_SIZE);
+    if (IsReplay(counter))
+    {
+        ++m_rejected;
+        return -1;
+    }
+
+    if (m_peerKnown)
+    {
+        memcpy(key, m_openKey, sizeof(key));
+    }
+    else
+    {
+        DeriveKey(header, key);
+    }
+
+    size -= OVERHEAD;
+    MakeNonce(nonce, 1 - m_side, header + SALT_SIZE);
+
+    ChaChaState state(key, nonce);
+    AeadTag(state, text, size, tag);
+    memset(key, 0, sizeof(key));
+
+    // constant time, a mismatch must not tell how many bytes were right
+    unsigned char diff = 0;
+    for (int i = 0; i < TAG_SIZE; i++)
+    {
+        diff |= tag[i] ^ text[size + i];
+    }
+
+    if (diff != 0)
+    {
+        ++m_rejected;
+        return -1;
+    }
+
+    // only authentic packets move the window or fix the salt
+    if (!m_peerKnown)
+    {
+        DeriveKey(header, m_openKey);
+        memcpy(m_peerSalt, header, SALT_SIZE);
+        m_peerKnown = true;
+        m_highest = counter;
+        m_window = 1;
+    }
+    else if (counter > m_highest)
+    {
+        IUINT64 ahead = counter - m_highest;
+        m_window = (ahead < REPLAY_WINDOW) ? ((m_window << ahead) | 1) : 1;
+        m_highest = counter;
+    }
+    else
+    {
+        m_window |= (IUINT64)1 << (m_highest - counter);
+    }
+
+    ChaChaXor(state, 1, text, (unsigned char*)out, size);
+    return size;
+}
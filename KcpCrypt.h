@@ -0,0 +1,134 @@
+#ifndef __KCP_CRYPT_H__
+#define __KCP_CRYPT_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpCrypt.h
+///
+/// @brief ChaCha20-Poly1305 (RFC 8439) encryption of kcp datagrams.
+///
+/// Every datagram is sealed in place on the kcp->output path, so no copy
+/// is made: ikcp_reserve keeps HEADER_SIZE bytes in front of kcp->buffer
+/// for the packet counter and TAG_SIZE bytes behind it for the tag.
+///
+/// Packet layout, little endian like the kcp header:
+///     salt(8) | counter(8) | ciphertext | tag(16)
+/// The salt is drawn at random by the sender when it is constructed and
+/// picks its key, so a restarted end never repeats a key stream of the
+/// previous run. The nonce is the side of the sender, three zero bytes
+/// and the counter.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ikcp.h"
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpAead
+///
+/// Seals outgoing and opens incoming datagrams of one kcp session. Each
+/// direction has its own key, derived from the master key, the conv and
+/// the salt of the sender. Open takes the salt of the first authentic
+/// packet as the one of the other end and refuses any other afterwards,
+/// and refuses counters seen already or older than REPLAY_WINDOW.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpAead
+{
+public:
+
+    enum
+    {
+        /// master key size
+        KEY_SIZE = 32,
+        /// random salt of the sender, first in the packet
+        SALT_SIZE = 8,
+        /// salt and packet counter in front of the datagram
+        HEADER_SIZE = SALT_SIZE + 8,
+        /// poly1305 tag behind the datagram
+        TAG_SIZE = 16,
+        /// added to every datagram
+        OVERHEAD = HEADER_SIZE + TAG_SIZE,
+        /// counters this far behind the highest one opened are refused
+        REPLAY_WINDOW = 64,
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] key - KEY_SIZE bytes master key, same on both ends
+    /// @param[in] conv - kcp conv of the session
+    /// @param[in] side - 0 on one end, 1 on the other, must differ
+    ////////////////////////////////////////////////////////////////////////////
+    KcpAead(const unsigned char* key, IUINT32 conv, int side);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor, wipes the keys
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpAead();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Encrypt a datagram in place and frame it
+    /// @param[in,out] data - datagram, HEADER_SIZE bytes before it and
+    ///                TAG_SIZE bytes after it must be writable
+    /// @param[in] size - datagram size
+    /// @return packet size, the packet starts at data - HEADER_SIZE
+    ////////////////////////////////////////////////////////////////////////////
+    int Seal(char* data, int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Check and decrypt a packet of the other end
+    /// @param[in] packet - packet
+    /// @param[in] size - packet size
+    /// @param[out] out - room for size - OVERHEAD bytes, may be
+    ///             packet + HEADER_SIZE to decrypt in place
+    /// @return datagram size, -1 if the packet is not authentic or a
+    ///         replay
+    ////////////////////////////////////////////////////////////////////////////
+    int Open(const char* packet, int size, char* out);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of packets rejected by Open
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetRejected() const
+    {
+        return m_rejected;
+    }
+
+private:
+
+    /// Forbid copy constructor
+    KcpAead(const KcpAead&);
+    /// Forbid assignment operator
+    KcpAead& operator=(const KcpAead&);
+
+    static void MakeSalt(unsigned char* salt);
+    void DeriveKey(const unsigned char* salt, IUINT32* key) const;
+    bool IsReplay(IUINT64 counter) const;
+
+    /// master key as chacha20 state words, for the key of the other end
+    IUINT32 m_master[8];
+    IUINT32 m_conv;
+
+    /// key of our packets
+    IUINT32 m_sealKey[8];
+    unsigned char m_salt[SALT_SIZE];
+
+    /// key of the packets of the other end, once its salt is known
+    IUINT32 m_openKey[8];
+    unsigned char m_peerSalt[SALT_SIZE];
+    bool m_peerKnown;
+
+    /// side byte of our nonces
+    int m_side;
+
+    /// counter of the next sealed packet
+    IUINT64 m_counter;
+
+    /// highest counter opened, and bit i set if counter highest - i was
+    IUINT64 m_highest;
+    IUINT64 m_window;
+
+    IUINT32 m_rejected;
+};
+
+
+#endif // __KCP_CRYPT_H__
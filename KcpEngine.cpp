@@ -0,0 +1,561 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpEngine.cpp
+///
+/// @brief Multi-threaded kcp server, one worker per core.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <linux/filter.h>
+
+#include "KcpEngine.h"
+#include "LibLog.h"
+#include "LibTime.h"
+
+// reuseport programs appeared in linux 4.5, older headers lack them
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef BPF_MOD
+#define BPF_MOD 0x90
+#endif
+
+// shorter than one kcp segment header
+#define KCP_MIN_DATAGRAM 24
+
+// commands of ikcp.c, the first datagram of a session is checked against
+#define KCP_CMD_PUSH 81
+#define KCP_CMD_SACK 85
+
+// what the default kcp mtu fits in, sessions keeping a larger one send
+// their datagrams one by one
+#define KCP_BATCH_MTU 1400
+
+typedef std::map<IUINT32, KcpEngine::Session*> KcpEngineSessionMap;
+
+//------------------------------------------------------------------------------
+// Everything one worker thread touches: nothing here is read by another
+// thread but sessionCount.
+//------------------------------------------------------------------------------
+struct KcpEngine::Worker
+{
+    Worker(KcpEngine* owner, int i, IUINT32 now):
+    engine(owner),
+    index(i),
+    wheel(now),
+    message(2048),
+    lastSweep(now),
+    pendingCount(0),
+    sessionCount(0),
+    started(false)
+    {
+        batch = ikcp_batch_create(VSocket::SEND_BATCH_MAX, KCP_BATCH_MTU, KcpEngine::BatchOutput, this);
+        pool = ikcp_pool_create(KCP_BATCH_MTU, 0);
+    }
+
+    ~Worker()
+    {
+        if (batch != NULL)
+        {
+            ikcp_batch_release(batch);
+        }
+        if (pool != NULL)
+        {
+            ikcp_pool_release(pool);
+        }
+    }
+
+    KcpEngine* engine;
+    int index;
+    UdpSocket sock;
+    DatagramRing ring;
+    KcpTimerWheel wheel;
+    KcpEngineSessionMap sessions;
+
+    /// sessions which got input in the current drain
+    std::vector<Session*> touched;
+
+    /// datagrams of all sessions, sent with one sendmmsg
+    ikcpbatch* batch;
+
+    /// segments of all sessions, allocated without locks
+    ikcppool* pool;
+
+    /// reassembled message handed to OnMessage
+    std::vector<char> message;
+
+    IUINT32 lastSweep;
+
+    /// sessions still pending, at most MAX_PENDING
+    int pendingCount;
+
+    volatile int sessionCount;
+    pthread_t thread;
+    bool started;
+};
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpEngine::KcpEngine(Handler* handler, int workers, Routing routing):
+m_handler(handler),
+m_count(workers),
+m_routing(routing),
+m_port(0),
+m_idleTimeout(IDLE_TIMEOUT),
+m_running(false)
+{
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpEngine::~KcpEngine()
+{
+    Stop();
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpEngine::Start(in_port_t port, in_addr_t ipAddr)
+{
+    if ((m_count < 1) || (m_count > MAX_WORKERS) || !m_workers.empty())
+    {
+        return -1;
+    }
+
+    IUINT32 now = (IUINT32)GetCurrTimeAsLong();
+
+    // bind in worker order: the kernel numbers the sockets of the port
+    // the same way, which is what the conv program returns
+    for (int i = 0; i < m_count; i++)
+    {
+        Worker* worker = new Worker(this, i, now);
+        m_workers.push_back(worker);
+
+        if ((NULL == worker->batch) || (NULL == worker->pool))
+        {
+            Stop();
+            return -1;
+        }
+
+        worker->sock.SetReusePort(true);
+        if (worker->sock.Create(port, ipAddr) < 0)
+        {
+            Stop();
+            return -1;
+        }
+        worker->sock.SetBlock(false);
+
+        // the others join the port the first one got
+        port = worker->sock.GetPort();
+    }
+    m_port = port;
+
+    if ((ROUTE_CONV == m_routing) && (AttachConvFilter() < 0))
+    {
+        AppLog(LOG_BASE, "--- no reuseport program, sessions routed by peer\n");
+        m_routing = ROUTE_PEER;
+    }
+
+    m_running = true;
+    for (int i = 0; i < m_count; i++)
+    {
+        Worker* worker = m_workers[i];
+        if (pthread_create(&worker->thread, NULL, WorkerMain, worker) != 0)
+        {
+            Stop();
+            return -1;
+        }
+        worker->started = true;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void KcpEngine::Stop()
+{
+    m_running = false;
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        if (m_workers[i]->started)
+        {
+            pthread_join(m_workers[i]->thread, NULL);
+        }
+        delete m_workers[i];
+    }
+    m_workers.clear();
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpEngine::Send(Session& session, const char* data, int size)
+{
+    return m_workers[session.worker]->wheel.Send(session.handle, data, size);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpEngine::GetSessionCount(int worker) const
+{
+    if ((worker < 0) || (worker >= (int)m_workers.size()))
+    {
+        return 0;
+    }
+
+    return m_workers[worker]->sessionCount;
+}
+
+//------------------------------------------------------------------------------
+// Steer datagrams to socket conv % workers. The program sees the UDP
+// payload, whose first 4 bytes are the conv, little endian. A datagram
+// too short to load ends the program with 0, worker 0 then drops it.
+//------------------------------------------------------------------------------
+int KcpEngine::AttachConvFilter()
+{
+    struct sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 24),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (IUINT32)m_count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    // one socket of the port carries the program for all of them
+    return setsockopt(m_workers[0]->sock.GetFd(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+//------------------------------------------------------------------------------
+// Worker thread: update due sessions, then wait for input until the next
+// one is due.
+//------------------------------------------------------------------------------
+void* KcpEngine::WorkerMain(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    KcpEngine* engine = worker->engine;
+
+    // kcp objects created by this thread take segments from its pool
+    ikcp_setpool_thread(worker->pool);
+
+    while (engine->m_running)
+    {
+        IUINT32 now = (IUINT32)GetCurrTimeAsLong();
+        worker->wheel.Run(now);
+        ikcp_batch_flush(worker->batch);
+
+        if (worker->sock.WaitInput(worker->wheel.NextTimeout(now, MAX_WAIT)))
+        {
+            engine->Drain(*worker, (IUINT32)GetCurrTimeAsLong());
+        }
+
+        now = (IUINT32)GetCurrTimeAsLong();
+        if ((IINT32)(now - worker->lastSweep) >= SWEEP_INTERVAL)
+        {
+            worker->lastSweep = now;
+            engine->Sweep(*worker, now);
+        }
+    }
+
+    while (!worker->sessions.empty())
+    {
+        engine->Release(*worker, worker->sessions.begin()->second);
+    }
+
+    ikcp_setpool_thread(NULL);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// outputv of sessions which could not join the batch.
+//------------------------------------------------------------------------------
+int KcpEngine::Output(const struct IKCPIOV* iov, int count, ikcpcb* kcp, void* user)
+{
+    Session* session = (Session*)user;
+    Worker* worker = session->engine->m_workers[session->worker];
+    struct iovec vec[128];
+
+    (void)kcp;
+    if (count > 128)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        vec[i].iov_base = (void*)iov[i].base;
+        vec[i].iov_len = iov[i].len;
+    }
+    return worker->sock.SendV(vec, count, session->peer);
+}
+
+//------------------------------------------------------------------------------
+// Batch output: every datagram to the peer of the session it came from.
+//------------------------------------------------------------------------------
+int KcpEngine::BatchOutput(ikcpbatch* batch, void* user)
+{
+    Worker* worker = (Worker*)user;
+    struct iovec data[VSocket::SEND_BATCH_MAX];
+    const SocketAddress* to[VSocket::SEND_BATCH_MAX];
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        data[i].iov_base = batch->dgrams[i].data;
+        data[i].iov_len = batch->dgrams[i].len;
+        to[i] = &((Session*)batch->dgrams[i].user)->peer;
+    }
+    return worker->sock.SendBatch(data, to, batch->count);
+}
+
+//------------------------------------------------------------------------------
+// Read every pending datagram, hand each to the kcp of its conv, then
+// deliver and flush each session that got input once for all of them.
+//------------------------------------------------------------------------------
+void KcpEngine::Drain(Worker& worker, IUINT32 now)
+{
+    // the socket is non-blocking, a partial batch means it is empty
+    while (worker.ring.Recv(worker.sock) > 0)
+    {
+        for (int n = 0; n < worker.ring.Count(); n++)
+        {
+            const char* data = worker.ring.Data(n);
+            int size = worker.ring.Size(n);
+
+            if (size < KCP_MIN_DATAGRAM)
+            {
+                continue;
+            }
+
+            IUINT32 conv = ikcp_getconv(data);
+            KcpEngineSessionMap::iterator it = worker.sessions.find(conv);
+            Session* session = NULL;
+            if (it == worker.sessions.end())
+            {
+                session = Accept(worker, data, size, worker.ring.From(n), now);
+                if (NULL == session)
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                session = it->second;
+                if (session->pending)
+                {
+                    session->pending = false;
+                    --worker.pendingCount;
+                }
+            }
+
+            // follow the peer across NAT rebinding, which only reaches
+            // this worker again when routing by conv
+            session->peer = worker.ring.From(n);
+            session->lastInput = now;
+            if (!session->touched)
+            {
+                session->touched = true;
+                worker.touched.push_back(session);
+            }
+            ikcp_input(session->kcp, data, size);
+        }
+
+        if (worker.ring.Count() < worker.ring.Capacity())
+        {
+            break;
+        }
+    }
+
+    // replies sent by OnMessage leave with the acks of the same flush
+    for (size_t i = 0; i < worker.touched.size(); i++)
+    {
+        Session* session = worker.touched[i];
+        session->touched = false;
+        Deliver(worker, *session);
+        ikcp_flush(session->kcp);
+        worker.wheel.Rearm(session->handle);
+    }
+    worker.touched.clear();
+
+    ikcp_batch_flush(worker.batch);
+    worker.sessionCount = (int)worker.sessions.size();
+}
+
+//------------------------------------------------------------------------------
+// Check that a datagram may open a session: well formed segments which
+// fill it exactly, the first a push of sn 0 with a window. Anything else
+// is a stray of a session already gone, or noise.
+//------------------------------------------------------------------------------
+bool KcpEngine::IsOpening(const char* data, int size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    IUINT32 conv = ikcp_getconv(data);
+
+    for (int offset = 0; offset < size; )
+    {
+        // a trailing fragment too short for a header is never decoded
+        if (size - offset < KCP_MIN_DATAGRAM)
+        {
+            return false;
+        }
+
+        const unsigned char* h = p + offset;
+        IUINT32 cmd = h[4];
+        IUINT32 wnd = h[6] | (h[7] << 8);
+        IUINT32 sn = h[12] | (h[13] << 8) | (h[14] << 16) | ((IUINT32)h[15] << 24);
+        IUINT32 len = h[20] | (h[21] << 8) | (h[22] << 16) | ((IUINT32)h[23] << 24);
+
+        if ((ikcp_getconv(h) != conv) ||
+            (cmd < KCP_CMD_PUSH) || (cmd > KCP_CMD_SACK) ||
+            (len > (IUINT32)(size - offset - KCP_MIN_DATAGRAM)))
+        {
+            return false;
+        }
+
+        if ((0 == offset) && ((KCP_CMD_PUSH != cmd) || (0 != sn) || (0 == wnd)))
+        {
+            return false;
+        }
+
+        offset += KCP_MIN_DATAGRAM + (int)len;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Create the session of the first datagram of a conv.
+//------------------------------------------------------------------------------
+KcpEngine::Session* KcpEngine::Accept(Worker& worker, const char* data, int size, const SocketAddress& from, IUINT32 now)
+{
+    if ((worker.pendingCount >= MAX_PENDING) || !IsOpening(data, size))
+    {
+        return NULL;
+    }
+
+    IUINT32 conv = ikcp_getconv(data);
+    Session* session = new Session;
+
+    session->kcp = ikcp_create(conv, session);
+    if (NULL == session->kcp)
+    {
+        delete session;
+        return NULL;
+    }
+
+    session->peer = from;
+    session->worker = worker.index;
+    session->user = NULL;
+    session->engine = this;
+    session->lastInput = now;
+    session->touched = false;
+    session->closing = false;
+    session->pending = true;
+    session->kcp->outputv = Output;
+
+    // scheduled before OnAccept, which may already send
+    worker.wheel.Add(session->handle, session->kcp, session);
+
+    if (!m_handler->OnAccept(*session))
+    {
+        worker.wheel.Remove(session->handle);
+        ikcp_release(session->kcp);
+        delete session;
+        return NULL;
+    }
+
+    // -1 if OnAccept raised the mtu past the batch slots, outputv then
+    ikcp_setbatch(session->kcp, worker.batch);
+    worker.wheel.Rearm(session->handle);
+
+    worker.sessions[conv] = session;
+    ++worker.pendingCount;
+    return session;
+}
+
+//------------------------------------------------------------------------------
+// Hand every complete message of a session to OnMessage.
+//------------------------------------------------------------------------------
+void KcpEngine::Deliver(Worker& worker, Session& session)
+{
+    int size;
+
+    while (!session.closing && ((size = ikcp_peeksize(session.kcp)) >= 0))
+    {
+        if ((int)worker.message.size() <= size)
+        {
+            worker.message.resize(size + 1);
+        }
+
+        ikcp_recv(session.kcp, &worker.message[0], size);
+        m_handler->OnMessage(session, &worker.message[0], size);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Release closed, dead and idle sessions.
+//------------------------------------------------------------------------------
+void KcpEngine::Sweep(Worker& worker, IUINT32 now)
+{
+    KcpEngineSessionMap::iterator it = worker.sessions.begin();
+
+    while (it != worker.sessions.end())
+    {
+        Session* session = it->second;
+        ++it;
+
+        // lastInput of a pending session is its first datagram
+        if (session->closing || ((IUINT32)-1 == session->kcp->state) ||
+            (session->pending && ((IINT32)(now - session->lastInput) >= PENDING_TIMEOUT)) ||
+            ((m_idleTimeout > 0) && ((IINT32)(now - session->lastInput) >= m_idleTimeout)))
+        {
+            Release(worker, session);
+        }
+    }
+
+    worker.sessionCount = (int)worker.sessions.size();
+}
+
+//------------------------------------------------------------------------------
+// Tell the handler and free a session.
+//------------------------------------------------------------------------------
+void KcpEngine::Release(Worker& worker, Session* session)
+{
+    m_handler->OnClose(*session);
+
+    // pending datagrams point at the session
+    ikcp_batch_flush(worker.batch);
+
+    if (session->pending)
+    {
+        --worker.pendingCount;
+    }
+
+    worker.wheel.Remove(session->handle);
+    worker.sessions.erase(session->kcp->conv);
+    ikcp_release(session->kcp);
+    delete session;
+}
@@ -0,0 +1,244 @@
+#ifndef __KCP_ENGINE_H__
+#define __KCP_ENGINE_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpEngine.h
+///
+/// @brief Multi-threaded kcp server, one worker per core.
+///
+/// Every worker owns a UDP socket bound to the same port with SO_REUSEPORT,
+/// its own session table and timer wheel, and runs on its own thread, so
+/// workers share nothing while handling packets. The kernel picks the
+/// socket of each datagram: by conv % workers with a classic BPF program
+/// where the kernel supports it (linux 4.5), otherwise by a hash of the
+/// peer address. By conv all datagrams of a session reach one worker. By
+/// peer address only as long as the address stays: after a NAT rebinding
+/// they reach a worker which does not know the conv and drops them, so
+/// the session does not survive it.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <pthread.h>
+#include <vector>
+
+#include "ikcp.h"
+#include "Socket.h"
+#include "KcpTimer.h"
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpEngine
+///
+/// Accepts kcp sessions on one port and hands their messages to a Handler
+/// on the thread of the worker owning the session. The conv of the first
+/// datagram of a session picks it, so convs must be unique per server.
+/// Datagrams are plain kcp: the conv routing reads the first 4 bytes.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpEngine
+{
+public:
+
+    enum
+    {
+        /// most workers Start creates
+        MAX_WORKERS = 64,
+        /// a session without input for this long is closed, ms
+        IDLE_TIMEOUT = 60000,
+        /// idle and dead sessions are looked for this often, ms
+        SWEEP_INTERVAL = 1000,
+        /// longest wait for input while kcp has nothing to do, ms
+        MAX_WAIT = 10,
+        /// most pending sessions per worker, first datagrams of new convs
+        /// are dropped beyond it
+        MAX_PENDING = 1024,
+        /// a pending session without a second datagram for this long is
+        /// closed, ms
+        PENDING_TIMEOUT = 10000,
+    };
+
+    enum Routing
+    {
+        /// kernel hash of the peer address and port, sessions end when
+        /// the peer address changes
+        ROUTE_PEER = 0,
+        /// conv % workers, computed by the kernel
+        ROUTE_CONV = 1,
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief A kcp session, owned by one worker
+    ////////////////////////////////////////////////////////////////////////////
+    class Session
+    {
+    public:
+        ikcpcb* kcp;
+        /// address of the last datagram of the session
+        SocketAddress peer;
+        /// index of the owning worker
+        int worker;
+        /// left to the Handler
+        void* user;
+
+    private:
+        friend class KcpEngine;
+        KcpTimerWheel::Handle handle;
+        KcpEngine* engine;
+        /// kcp clock of the last datagram
+        IUINT32 lastInput;
+        /// got input in the current drain
+        bool touched;
+        /// Close was called
+        bool closing;
+        /// accepted, no datagram after the first one yet
+        bool pending;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Session events, called on the thread of the owning worker,
+    ///        concurrently for sessions of different workers
+    ////////////////////////////////////////////////////////////////////////////
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+
+        /// first datagram of an unknown conv, a push of sn 0: configure
+        /// session.kcp, return false to drop the datagram and forget the
+        /// session
+        virtual bool OnAccept(Session& session) { (void)session; return true; }
+
+        /// one received message, valid until the call returns
+        virtual void OnMessage(Session& session, const char* data, int size) = 0;
+
+        /// the session is released after the call
+        virtual void OnClose(Session& session) { (void)session; }
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] handler - session events, not owned
+    /// @param[in] workers - number of worker threads, 1 to MAX_WORKERS
+    /// @param[in] routing - how the kernel spreads datagrams, ROUTE_CONV
+    ///            falls back to ROUTE_PEER where unsupported
+    ////////////////////////////////////////////////////////////////////////////
+    KcpEngine(Handler* handler, int workers, Routing routing = ROUTE_CONV);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor, stops the workers
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpEngine();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Bind the sockets and start the workers
+    /// @param[in] port - port shared by the workers, 0 for any
+    /// @param[in] ipAddr - IP address. Default is any.
+    /// @return 0 if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    int Start(in_port_t port, in_addr_t ipAddr = INADDR_ANY);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Stop and join the workers, open sessions get OnClose
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Stop();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Queue a message on a session, from its worker thread only,
+    ///        i.e. from a Handler call
+    /// @param[in] session - session
+    /// @param[in] data - message
+    /// @param[in] size - message size
+    /// @return what ikcp_send returns
+    ////////////////////////////////////////////////////////////////////////////
+    int Send(Session& session, const char* data, int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Close a session at the next sweep, from its worker thread only
+    /// @param[in] session - session
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    inline void Close(Session& session)
+    {
+        session.closing = true;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Set the time without input after which a session is closed
+    /// @param[in] idleTimeout - milliseconds, 0 never closes idle sessions
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    inline void SetIdleTimeout(int idleTimeout)
+    {
+        m_idleTimeout = idleTimeout;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get the routing in effect once started
+    /// @return ROUTE_PEER or ROUTE_CONV
+    ////////////////////////////////////////////////////////////////////////////
+    inline Routing GetRouting() const
+    {
+        return m_routing;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get the port the workers are bound to
+    /// @return port
+    ////////////////////////////////////////////////////////////////////////////
+    inline in_port_t GetPort() const
+    {
+        return m_port;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of workers
+    /// @return count
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetWorkers() const
+    {
+        return m_count;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of sessions of a worker, from any thread
+    /// @param[in] worker - worker index
+    /// @return count, as of the last drain or sweep
+    ////////////////////////////////////////////////////////////////////////////
+    int GetSessionCount(int worker) const;
+
+private:
+
+    struct Worker;
+
+    /// Forbid copy constructor
+    KcpEngine(const KcpEngine&);
+    /// Forbid assignment operator
+    KcpEngine& operator=(const KcpEngine&);
+
+    static void* WorkerMain(void* arg);
+    static int Output(const struct IKCPIOV* iov, int count, ikcpcb* kcp, void* user);
+    static int BatchOutput(ikcpbatch* batch, void* user);
+    static bool IsOpening(const char* data, int size);
+
+    int AttachConvFilter();
+    void Drain(Worker& worker, IUINT32 now);
+    Session* Accept(Worker& worker, const char* data, int size, const SocketAddress& from, IUINT32 now);
+    void Deliver(Worker& worker, Session& session);
+    void Sweep(Worker& worker, IUINT32 now);
+    void Release(Worker& worker, Session* session);
+
+    Handler* m_handler;
+    int m_count;
+    Routing m_routing;
+    in_port_t m_port;
+    int m_idleTimeout;
+
+    /// cleared by Stop, read by the workers
+    volatile bool m_running;
+
+    std::vector<Worker*> m_workers;
+};
+
+
+#endif // __KCP_ENGINE_H__
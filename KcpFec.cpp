@@ -0,0 +1,651 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpFec.cpp
+///
+/// @brief Reed-Solomon forward error correction for kcp datagrams.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <string.h>
+
+// the SSSE3 kernel is built either for every cpu, with -mssse3, or next
+// to the plain loop and picked at run time where the compiler can
+#if defined(__SSSE3__)
+#define KCP_FEC_SSSE3
+#define KCP_FEC_TARGET
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+    (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define KCP_FEC_SSSE3
+#define KCP_FEC_TARGET __attribute__((target("ssse3")))
+#define KCP_FEC_DISPATCH
+#endif
+
+#if defined(KCP_FEC_SSSE3)
+#include <tmmintrin.h>
+#endif
+
+#include "KcpFec.h"
+
+//------------------------------------------------------------------------------
+// GF(256) over x^8 + x^4 + x^3 + x^2 + 1.
+//------------------------------------------------------------------------------
+struct GfTables
+{
+    unsigned char exp[512];
+    unsigned char log[256];
+    unsigned char mul[256][256];
+
+    GfTables()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = (unsigned char)x;
+            exp[i + 255] = (unsigned char)x;
+            log[x] = (unsigned char)i;
+            x <<= 1;
+            if (x & 0x100)
+            {
+                x ^= 0x11d;
+            }
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+        log[0] = 0;
+
+        for (int a = 0; a < 256; a++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            }
+        }
+    }
+};
+
+static const GfTables& Gf()
+{
+    static GfTables tables;
+    return tables;
+}
+
+static unsigned char GfInv(unsigned char a)
+{
+    return Gf().exp[255 - Gf().log[a]];
+}
+
+#if defined(KCP_FEC_SSSE3)
+//------------------------------------------------------------------------------
+// dst ^= row[src] over the first n & ~15 bytes, returns their count. every
+// byte is split in nibbles looked up 16 at a time by pshufb in the
+// products of c with 0..15 and with 0x00..0xf0.
+//------------------------------------------------------------------------------
+static KCP_FEC_TARGET int GfMulAdd16(unsigned char* dst, const unsigned char* src,
+    const unsigned char* row, int n)
+{
+    unsigned char lo[16], hi[16];
+    int i = 0;
+
+    for (int t = 0; t < 16; t++)
+    {
+        lo[t] = row[t];
+        hi[t] = row[t << 4];
+    }
+
+    __m128i tlo = _mm_loadu_si128((const __m128i*)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i*)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i l = _mm_and_si128(x, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, p));
+    }
+
+    return i;
+}
+
+static bool HasSsse3()
+{
+#if defined(KCP_FEC_DISPATCH)
+    static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3") != 0);
+    return has;
+#else
+    return true;
+#endif
+}
+#endif
+
+//------------------------------------------------------------------------------
+// dst ^= c * src over n bytes.
+//------------------------------------------------------------------------------
+static void GfMulAdd(unsigned char* dst, const unsigned char* src, unsigned char c, int n)
+{
+    const unsigned char* row = Gf().mul[c];
+    int i = 0;
+
+    if (0 == c)
+    {
+        return;
+    }
+
+#if defined(KCP_FEC_SSSE3)
+    if ((n >= 16) && HasSsse3())
+    {
+        i = GfMulAdd16(dst, src, row, n);
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+//------------------------------------------------------------------------------
+// Parity rows of a systematic Cauchy code: 1 / ((k + i) ^ j). any square
+// pick of identity and Cauchy rows over the first columns is invertible,
+// which also covers groups shortened to fewer data shards.
+//------------------------------------------------------------------------------
+static void BuildMatrix(int dataShards, int parityShards, unsigned char* matrix)
+{
+    for (int i = 0; i < parityShards; i++)
+    {
+        for (int j = 0; j < dataShards; j++)
+        {
+            matrix[i * dataShards + j] = GfInv((unsigned char)((dataShards + i) ^ j));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Gauss-Jordan inversion of the n x n 'work', destroyed, into 'inverse'.
+//------------------------------------------------------------------------------
+static bool Invert(unsigned char* work, unsigned char* inverse, int n)
+{
+    const GfTables& gf = Gf();
+
+    memset(inverse, 0, n * n);
+    for (int i = 0; i < n; i++)
+    {
+        inverse[i * n + i] = 1;
+    }
+
+    for (int col = 0; col < n; col++)
+    {
+        int pivot = col;
+        while ((pivot < n) && (0 == work[pivot * n + col]))
+        {
+            ++pivot;
+        }
+        if (pivot == n)
+        {
+            return false;
+        }
+
+        if (pivot != col)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                unsigned char t = work[col * n + j];
+                work[col * n + j] = work[pivot * n + j];
+                work[pivot * n + j] = t;
+                t = inverse[col * n + j];
+                inverse[col * n + j] = inverse[pivot * n + j];
+                inverse[pivot * n + j] = t;
+            }
+        }
+
+        unsigned char scale = GfInv(work[col * n + col]);
+        for (int j = 0; j < n; j++)
+        {
+            work[col * n + j] = gf.mul[scale][work[col * n + j]];
+            inverse[col * n + j] = gf.mul[scale][inverse[col * n + j]];
+        }
+
+        for (int r = 0; r < n; r++)
+        {
+            unsigned char f = work[r * n + col];
+            if ((r == col) || (0 == f))
+            {
+                continue;
+            }
+            GfMulAdd(work + r * n, work + col * n, f, n);
+            GfMulAdd(inverse + r * n, inverse + col * n, f, n);
+        }
+    }
+
+    return true;
+}
+
+static void WriteHeader(char* p, IUINT32 seqid, int type, int count)
+{
+    p[0] = (char)(seqid & 0xff);
+    p[1] = (char)((seqid >> 8) & 0xff);
+    p[2] = (char)((seqid >> 16) & 0xff);
+    p[3] = (char)((seqid >> 24) & 0xff);
+    p[4] = (char)type;
+    p[5] = (char)count;
+}
+
+static IUINT32 ReadSeqid(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (IUINT32)u[0] | ((IUINT32)u[1] << 8) | ((IUINT32)u[2] << 16) | ((IUINT32)u[3] << 24);
+}
+
+static int ReadSize(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (int)u[0] | ((int)u[1] << 8);
+}
+
+//------------------------------------------------------------------------------
+// Keep the shard counts within what one byte of count and GF(256) allow.
+//------------------------------------------------------------------------------
+static void ClampShards(int& dataShards, int& parityShards)
+{
+    if (dataShards < 1)
+    {
+        dataShards = 1;
+    }
+    if (dataShards > 255)
+    {
+        dataShards = 255;
+    }
+    if (parityShards < 0)
+    {
+        parityShards = 0;
+    }
+    if (dataShards + parityShards > 255)
+    {
+        parityShards = 255 - dataShards;
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpFecEncoder::KcpFecEncoder(int dataShards, int parityShards, int mtu):
+m_seqid(0),
+m_count(0),
+m_maxSize(0)
+{
+    ClampShards(dataShards, parityShards);
+    m_dataShards = dataShards;
+    m_parityShards = parityShards;
+    m_shardSize = mtu + 2;
+
+    int total = dataShards + parityShards;
+    m_seqLimit = (0xffffffff / total) * total;
+    m_storage = new char[total * (HEADER_SIZE + m_shardSize)];
+    m_matrix = new unsigned char[parityShards * dataShards + 1];
+    BuildMatrix(dataShards, parityShards, m_matrix);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpFecEncoder::~KcpFecEncoder()
+{
+    delete[] m_storage;
+    delete[] m_matrix;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpFecEncoder::Encode(const char* data, int size, KcpFecOutput output, void* user)
+{
+    if ((size < 0) || (size + 2 > m_shardSize))
+    {
+        return -1;
+    }
+
+    char* packet = m_storage + m_count * (HEADER_SIZE + m_shardSize);
+    WriteHeader(packet, m_seqid, TYPE_DATA, 0);
+    packet[HEADER_SIZE] = (char)(size & 0xff);
+    packet[HEADER_SIZE + 1] = (char)((size >> 8) & 0xff);
+    memcpy(packet + OVERHEAD, data, size);
+
+    ++m_seqid;
+    ++m_count;
+    if (size + 2 > m_maxSize)
+    {
+        m_maxSize = size + 2;
+    }
+
+    int rc = output(packet, size + OVERHEAD, user);
+
+    if (m_count == m_dataShards)
+    {
+        EmitParity(output, user);
+    }
+
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpFecEncoder::Flush(KcpFecOutput output, void* user)
+{
+    if (0 == m_count)
+    {
+        return 0;
+    }
+
+    return EmitParity(output, user);
+}
+
+//------------------------------------------------------------------------------
+// Compute and send the parity of the m_count data shards stored, then
+// move on to the next group.
+//------------------------------------------------------------------------------
+int KcpFecEncoder::EmitParity(KcpFecOutput output, void* user)
+{
+    int stride = HEADER_SIZE + m_shardSize;
+    IUINT32 base = m_seqid - m_count;
+
+    // shorter shards count as zero padded
+    for (int j = 0; j < m_count; j++)
+    {
+        char* shard = m_storage + j * stride + HEADER_SIZE;
+        int size = ReadSize(shard) + 2;
+        memset(shard + size, 0, m_maxSize - size);
+    }
+
+    for (int i = 0; i < m_parityShards; i++)
+    {
+        char* packet = m_storage + (m_dataShards + i) * stride;
+        unsigned char* parity = (unsigned char*)packet + HEADER_SIZE;
+
+        memset(parity, 0, m_maxSize);
+        for (int j = 0; j < m_count; j++)
+        {
+            const unsigned char* shard = (const unsigned char*)m_storage + j * stride + HEADER_SIZE;
+            GfMulAdd(parity, shard, m_matrix[i * m_dataShards + j], m_maxSize);
+        }
+
+        WriteHeader(packet, base + m_dataShards + i, TYPE_PARITY, m_count);
+        output(packet, HEADER_SIZE + m_maxSize, user);
+    }
+
+    m_seqid = base + m_dataShards + m_parityShards;
+    if (m_seqid >= m_seqLimit)
+    {
+        m_seqid = 0;
+    }
+    m_count = 0;
+    m_maxSize = 0;
+
+    return m_parityShards;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpFecDecoder::KcpFecDecoder(int dataShards, int parityShards, int mtu):
+m_recovered(0),
+m_unrecovered(0),
+m_parity(0)
+{
+    ClampShards(dataShards, parityShards);
+    m_dataShards = dataShards;
+    m_parityShards = parityShards;
+    m_shardSize = mtu + 2;
+
+    int total = dataShards + parityShards;
+    for (int i = 0; i < GROUPS; i++)
+    {
+        Group& group = m_groups[i];
+        group.id = 0;
+        group.used = false;
+        group.done = false;
+        group.count = dataShards;
+        group.received = 0;
+        group.paritySize = 0;
+        group.present = new unsigned char[total];
+        group.sizes = new int[total];
+        group.shards = new char[total * m_shardSize];
+    }
+
+    m_matrix = new unsigned char[parityShards * dataShards + 1];
+    m_work = new unsigned char[dataShards * dataShards];
+    m_inverse = new unsigned char[dataShards * dataShards];
+    BuildMatrix(dataShards, parityShards, m_matrix);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpFecDecoder::~KcpFecDecoder()
+{
+    for (int i = 0; i < GROUPS; i++)
+    {
+        delete[] m_groups[i].present;
+        delete[] m_groups[i].sizes;
+        delete[] m_groups[i].shards;
+    }
+
+    delete[] m_matrix;
+    delete[] m_work;
+    delete[] m_inverse;
+}
+
+//------------------------------------------------------------------------------
+// Find the slot of a group, a newer group takes over the slot of an older
+// one. 'stale' tells the packet belongs to a group already given up.
+//------------------------------------------------------------------------------
+KcpFecDecoder::Group& KcpFecDecoder::Acquire(IUINT32 id, bool& stale)
+{
+    Group& group = m_groups[id % GROUPS];
+
+    stale = false;
+    if (group.used && (group.id == id))
+    {
+        return group;
+    }
+
+    // far behind means the seqid wrapped, not a late packet
+    if (group.used && ((IINT32)(id - group.id) < 0) &&
+        ((IINT32)(id - group.id) > -(IINT32)(GROUPS * 1024)))
+    {
+        stale = true;
+        return group;
+    }
+
+    Drop(group);
+
+    group.id = id;
+    group.used = true;
+    group.done = false;
+    group.count = m_dataShards;
+    group.received = 0;
+    group.paritySize = 0;
+    memset(group.present, 0, m_dataShards + m_parityShards);
+    return group;
+}
+
+//------------------------------------------------------------------------------
+// Account for the data shards a group is left without.
+//------------------------------------------------------------------------------
+void KcpFecDecoder::Drop(Group& group)
+{
+    if (!group.used || group.done)
+    {
+        return;
+    }
+
+    for (int j = 0; j < group.count; j++)
+    {
+        if (!group.present[j])
+        {
+            ++m_unrecovered;
+        }
+    }
+    group.used = false;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpFecDecoder::Decode(const char* data, int size, KcpFecOutput output, void* user)
+{
+    int total = m_dataShards + m_parityShards;
+    int delivered = 0;
+
+    if (size < KcpFecEncoder::HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    IUINT32 seqid = ReadSeqid(data);
+    int type = (unsigned char)data[4];
+    int count = (unsigned char)data[5];
+    int index = (int)(seqid % total);
+    int shardSize = size - KcpFecEncoder::HEADER_SIZE;
+
+    if (KcpFecEncoder::TYPE_DATA == type)
+    {
+        if ((index >= m_dataShards) || (size < KcpFecEncoder::OVERHEAD) ||
+            (ReadSize(data + KcpFecEncoder::HEADER_SIZE) != size - KcpFecEncoder::OVERHEAD) ||
+            (shardSize > m_shardSize))
+        {
+            return -1;
+        }
+
+        output(data + KcpFecEncoder::OVERHEAD, size - KcpFecEncoder::OVERHEAD, user);
+        ++delivered;
+    }
+    else if (KcpFecEncoder::TYPE_PARITY == type)
+    {
+        if ((index < m_dataShards) || (count < 1) || (count > m_dataShards) ||
+            (shardSize < 2) || (shardSize > m_shardSize))
+        {
+            return -1;
+        }
+        ++m_parity;
+    }
+    else
+    {
+        return -1;
+    }
+
+    bool stale;
+    Group& group = Acquire(seqid / total, stale);
+    if (stale || group.done || group.present[index])
+    {
+        return delivered;
+    }
+
+    memcpy(group.shards + index * m_shardSize, data + KcpFecEncoder::HEADER_SIZE, shardSize);
+    group.sizes[index] = shardSize;
+    group.present[index] = 1;
+    ++group.received;
+
+    if (KcpFecEncoder::TYPE_PARITY == type)
+    {
+        group.count = count;
+        group.paritySize = shardSize;
+    }
+
+    int have = 0;
+    for (int j = 0; j < group.count; j++)
+    {
+        have += group.present[j];
+    }
+
+    if (have == group.count)
+    {
+        group.done = true;
+    }
+    else if ((group.paritySize > 0) && (group.received >= group.count))
+    {
+        delivered += Rebuild(group, output, user);
+        group.done = true;
+    }
+
+    return delivered;
+}
+
+//------------------------------------------------------------------------------
+// Solve for the missing data shards of a group holding enough packets.
+//------------------------------------------------------------------------------
+int KcpFecDecoder::Rebuild(Group& group, KcpFecOutput output, void* user)
+{
+    int total = m_dataShards + m_parityShards;
+    int k = group.count;
+    int length = group.paritySize;
+    int rows[256];
+    int n = 0;
+
+    // data shards first, then parity until the system is square
+    for (int i = 0; (i < total) && (n < k); i++)
+    {
+        if (!group.present[i] || ((i >= k) && (i < m_dataShards)))
+        {
+            continue;
+        }
+
+        char* shard = group.shards + i * m_shardSize;
+        if (group.sizes[i] > length)
+        {
+            return 0;
+        }
+        memset(shard + group.sizes[i], 0, length - group.sizes[i]);
+
+        unsigned char* row = m_work + n * k;
+        if (i < m_dataShards)
+        {
+            memset(row, 0, k);
+            row[i] = 1;
+        }
+        else
+        {
+            memcpy(row, m_matrix + (i - m_dataShards) * m_dataShards, k);
+        }
+        rows[n++] = i;
+    }
+
+    if ((n < k) || !Invert(m_work, m_inverse, k))
+    {
+        return 0;
+    }
+
+    int rebuilt = 0;
+    for (int d = 0; d < k; d++)
+    {
+        if (group.present[d])
+        {
+            continue;
+        }
+
+        unsigned char* shard = (unsigned char*)group.shards + d * m_shardSize;
+        memset(shard, 0, length);
+        for (int r = 0; r < k; r++)
+        {
+            GfMulAdd(shard, (const unsigned char*)group.shards + rows[r] * m_shardSize,
+                m_inverse[d * k + r], length);
+        }
+
+        int size = ReadSize((const char*)shard);
+        group.present[d] = 1;
+        group.sizes[d] = length;
+        if (size + 2 > length)
+        {
+            continue;
+        }
+
+        output((const char*)shard + 2, size, user);
+        ++m_recovered;
+        ++rebuilt;
+    }
+
+    return rebuilt;
+}
@@ -0,0 +1,240 @@
+#ifndef __KCP_FEC_H__
+#define __KCP_FEC_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpFec.h
+///
+/// @brief Reed-Solomon forward error correction for kcp datagrams.
+///
+/// The encoder sits on the kcp->output path: every datagram goes out with
+/// a small header, and after each group of data shards it adds parity
+/// shards. The decoder sits before ikcp_input: data shards are passed on
+/// at once, and lost ones are rebuilt as soon as any dataShards packets
+/// of their group have arrived, without waiting for a retransmit.
+///
+/// Packet layout, little endian like the kcp header:
+///     seqid(4) type(1) count(1) | data: size(2) datagram | parity: bytes
+/// seqid / (dataShards + parityShards) is the group, seqid modulo it the
+/// shard index. count is the number of data shards of a parity's group,
+/// smaller than dataShards when Flush closed the group early.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ikcp.h"
+
+/// sink for packets and datagrams, returns below zero on error
+typedef int (*KcpFecOutput)(const char* data, int size, void* user);
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpFecEncoder
+///
+/// Adds the fec header to outgoing datagrams and emits parity shards.
+/// Shrink the kcp mtu by OVERHEAD so the packets still fit the link.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpFecEncoder
+{
+public:
+
+    enum
+    {
+        /// header of every packet
+        HEADER_SIZE = 6,
+        /// header and size prefix of a data packet
+        OVERHEAD = HEADER_SIZE + 2,
+        /// packet types
+        TYPE_DATA = 0xf1,
+        TYPE_PARITY = 0xf2,
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] dataShards - datagrams per group
+    /// @param[in] parityShards - parity packets per group, data plus parity
+    ///            is at most 255
+    /// @param[in] mtu - largest datagram to encode
+    ////////////////////////////////////////////////////////////////////////////
+    KcpFecEncoder(int dataShards, int parityShards, int mtu);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpFecEncoder();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Send one datagram, and the parity of its group once full
+    /// @param[in] data - datagram
+    /// @param[in] size - datagram size, at most mtu
+    /// @param[in] output - called for each packet
+    /// @param[in] user - passed to output
+    /// @return what output returned for the datagram, -1 if too large
+    ////////////////////////////////////////////////////////////////////////////
+    int Encode(const char* data, int size, KcpFecOutput output, void* user);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Close a partly filled group with its parity, so the last
+    ///        datagrams of a burst are protected too
+    /// @param[in] output - called for each parity packet
+    /// @param[in] user - passed to output
+    /// @return number of parity packets sent
+    ////////////////////////////////////////////////////////////////////////////
+    int Flush(KcpFecOutput output, void* user);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of datagrams of the group still without parity
+    /// @return count, 0 right after a full group or a Flush
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetPending() const
+    {
+        return m_count;
+    }
+
+private:
+
+    /// Forbid copy constructor
+    KcpFecEncoder(const KcpFecEncoder&);
+    /// Forbid assignment operator
+    KcpFecEncoder& operator=(const KcpFecEncoder&);
+
+    int EmitParity(KcpFecOutput output, void* user);
+
+    int m_dataShards;
+    int m_parityShards;
+
+    /// bytes per shard: size prefix and datagram
+    int m_shardSize;
+
+    /// seqid of the next packet
+    IUINT32 m_seqid;
+
+    /// seqid wraps here, so that groups never straddle the wrap
+    IUINT32 m_seqLimit;
+
+    /// data shards of the current group
+    int m_count;
+
+    /// largest shard of the current group
+    int m_maxSize;
+
+    /// header and shard of every packet of the group
+    char* m_storage;
+
+    /// parity rows of the code matrix
+    unsigned char* m_matrix;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpFecDecoder
+///
+/// Strips the fec header of incoming packets and rebuilds lost datagrams
+/// from the parity of their group.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpFecDecoder
+{
+public:
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor, shard counts and mtu must match the encoder's
+    ////////////////////////////////////////////////////////////////////////////
+    KcpFecDecoder(int dataShards, int parityShards, int mtu);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpFecDecoder();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Take one packet off the wire
+    /// @param[in] data - packet
+    /// @param[in] size - packet size
+    /// @param[in] output - called with the datagram it carries and with
+    ///            each datagram rebuilt thanks to it
+    /// @param[in] user - passed to output
+    /// @return number of datagrams passed to output, -1 if not a fec packet
+    ////////////////////////////////////////////////////////////////////////////
+    int Decode(const char* data, int size, KcpFecOutput output, void* user);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of datagrams rebuilt from parity
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetRecovered() const
+    {
+        return m_recovered;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of datagrams still missing when their group was
+    ///        dropped: lost beyond what parity covers, or arriving later
+    ///        than the groups kept for reordering
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetUnrecovered() const
+    {
+        return m_unrecovered;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of parity packets received
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetParity() const
+    {
+        return m_parity;
+    }
+
+private:
+
+    enum
+    {
+        /// groups kept for reordered packets
+        GROUPS = 16,
+    };
+
+    struct Group
+    {
+        IUINT32 id;
+        bool used;
+        /// every data shard is there, received or rebuilt
+        bool done;
+        /// data shards of the group, dataShards until a parity tells
+        int count;
+        /// packets received
+        int received;
+        /// largest parity shard, 0 if none yet
+        int paritySize;
+        unsigned char* present;
+        int* sizes;
+        char* shards;
+    };
+
+    /// Forbid copy constructor
+    KcpFecDecoder(const KcpFecDecoder&);
+    /// Forbid assignment operator
+    KcpFecDecoder& operator=(const KcpFecDecoder&);
+
+    Group& Acquire(IUINT32 id, bool& stale);
+    void Drop(Group& group);
+    int Rebuild(Group& group, KcpFecOutput output, void* user);
+
+    int m_dataShards;
+    int m_parityShards;
+    int m_shardSize;
+
+    Group m_groups[GROUPS];
+
+    /// parity rows of the code matrix
+    unsigned char* m_matrix;
+
+    /// scratch for the matrix inversion
+    unsigned char* m_work;
+    unsigned char* m_inverse;
+
+    IUINT32 m_recovered;
+    IUINT32 m_unrecovered;
+    IUINT32 m_parity;
+};
+
+
+#endif // __KCP_FEC_H__
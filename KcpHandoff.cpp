@@ -0,0 +1,360 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpHandoff.cpp
+///
+/// @brief Message handoff between an application thread and the thread
+///        owning a kcp object.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "KcpHandoff.h"
+
+// eventfd appeared in glibc 2.8, a pipe does the same job before
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 8)))
+#define HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+// full barrier: the positions are published with plain stores, and each
+// side must see the data before the position moving past it
+#define KCP_BARRIER() __sync_synchronize()
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpSpscRing::KcpSpscRing(int capacity):
+m_capacity(64),
+m_head(0),
+m_peekSkip(0),
+m_tail(0),
+m_reserveSkip(0)
+{
+    while ((int)m_capacity < capacity)
+    {
+        m_capacity <<= 1;
+    }
+    m_mask = m_capacity - 1;
+    m_buffer = new char[m_capacity];
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpSpscRing::~KcpSpscRing()
+{
+    delete [] m_buffer;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+char* KcpSpscRing::Reserve(int size)
+{
+    IUINT32 tail = m_tail;
+    IUINT32 need = Align(size);
+    IUINT32 offset = tail & m_mask;
+    IUINT32 skip = 0;
+
+    if ((size < 0) || (need > m_capacity / 2))
+    {
+        return NULL;
+    }
+
+    // records start 4 byte aligned, so a marker always fits the end
+    if (need > m_capacity - offset)
+    {
+        skip = m_capacity - offset;
+    }
+
+    KCP_BARRIER();
+    if (skip + need > m_capacity - (tail - m_head))
+    {
+        return NULL;
+    }
+
+    if (skip > 0)
+    {
+        *(IUINT32*)(m_buffer + offset) = WRAP;
+        offset = 0;
+    }
+
+    m_reserveSkip = skip;
+    return m_buffer + offset + HEADER_SIZE;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+bool KcpSpscRing::Commit(int size)
+{
+    IUINT32 tail = m_tail;
+    IUINT32 start = tail + m_reserveSkip;
+
+    *(IUINT32*)(m_buffer + (start & m_mask)) = (IUINT32)size;
+
+    KCP_BARRIER();
+    m_tail = start + Align(size);
+
+    // the consumer pops, then peeks again: if it had not caught up with
+    // the old tail yet, it sees the new one
+    KCP_BARRIER();
+    return (m_head == tail);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+const char* KcpSpscRing::Peek(int& size)
+{
+    IUINT32 head = m_head;
+    IUINT32 offset = head & m_mask;
+    IUINT32 length;
+
+    KCP_BARRIER();
+    if (m_tail == head)
+    {
+        return NULL;
+    }
+    KCP_BARRIER();
+
+    m_peekSkip = 0;
+    length = *(IUINT32*)(m_buffer + offset);
+    if (WRAP == length)
+    {
+        m_peekSkip = m_capacity - offset;
+        offset = 0;
+        length = *(IUINT32*)m_buffer;
+    }
+
+    size = (int)length;
+    return m_buffer + offset + HEADER_SIZE;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void KcpSpscRing::Pop()
+{
+    IUINT32 head = m_head + m_peekSkip;
+    IUINT32 length = *(IUINT32*)(m_buffer + (head & m_mask));
+
+    KCP_BARRIER();
+    m_head = head + Align((int)length);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpHandoff::KcpHandoff(ikcpcb* kcp, int capacity):
+m_kcp(kcp),
+m_sendRing(capacity),
+m_recvRing(capacity),
+m_recvBlocked(0),
+m_dropped(0)
+{
+    OpenFd(m_wakeFd);
+    OpenFd(m_recvFd);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpHandoff::~KcpHandoff()
+{
+    CloseFd(m_wakeFd);
+    CloseFd(m_recvFd);
+}
+
+//------------------------------------------------------------------------------
+// Open a non blocking eventfd, or a pipe.
+//------------------------------------------------------------------------------
+void KcpHandoff::OpenFd(int fd[2])
+{
+#ifdef HAVE_EVENTFD
+    fd[0] = eventfd(0, EFD_NONBLOCK);
+    fd[1] = fd[0];
+#else
+    if (pipe(fd) < 0)
+    {
+        fd[0] = -1;
+        fd[1] = -1;
+        return;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Close what OpenFd opened.
+//------------------------------------------------------------------------------
+void KcpHandoff::CloseFd(int fd[2])
+{
+    if (fd[0] >= 0)
+    {
+        close(fd[0]);
+    }
+    if (fd[1] != fd[0])
+    {
+        close(fd[1]);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Make the fd readable. A full pipe or eventfd is readable already.
+//------------------------------------------------------------------------------
+void KcpHandoff::Signal(const int fd[2])
+{
+    IUINT64 one = 1;
+
+    if (fd[1] >= 0)
+    {
+        ssize_t n = write(fd[1], &one, sizeof(one));
+        (void)n;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Make the fd unreadable again.
+//------------------------------------------------------------------------------
+void KcpHandoff::Clear(const int fd[2])
+{
+    char buffer[64];
+
+    if (fd[0] >= 0)
+    {
+        while (read(fd[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpHandoff::Send(const char* data, int size)
+{
+    if ((size < 0) || (size > m_sendRing.GetMaxRecord()))
+    {
+        return -2;
+    }
+
+    char* p = m_sendRing.Reserve(size);
+    if (NULL == p)
+    {
+        return -1;
+    }
+
+    memcpy(p, data, size);
+    if (m_sendRing.Commit(size))
+    {
+        Signal(m_wakeFd);
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpHandoff::Recv(char* buffer, int size)
+{
+    int length;
+    const char* p = m_recvRing.Peek(length);
+
+    if (NULL == p)
+    {
+        // a message committed before the clear has signalled already
+        Clear(m_recvFd);
+        p = m_recvRing.Peek(length);
+        if (NULL == p)
+        {
+            return -1;
+        }
+    }
+
+    if (length > size)
+    {
+        return -2;
+    }
+
+    memcpy(buffer, p, length);
+    m_recvRing.Pop();
+
+    KCP_BARRIER();
+    if (m_recvBlocked)
+    {
+        m_recvBlocked = 0;
+        Signal(m_wakeFd);
+    }
+    return length;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpHandoff::Drain()
+{
+    int moved = 0;
+    int size;
+    const char* data;
+
+    Clear(m_wakeFd);
+
+    // ikcp_send copies, so records leave the ring in order even though
+    // acks release segments out of order
+    while ((ikcp_waitsnd(m_kcp) < 2 * (int)m_kcp->snd_wnd) &&
+           (NULL != (data = m_sendRing.Peek(size))))
+    {
+        int hr = ikcp_send(m_kcp, data, size);
+        if (-3 == hr)
+        {
+            // over the memory limit, try again once acks free some
+            break;
+        }
+        if (hr < 0)
+        {
+            ++m_dropped;
+        }
+        m_sendRing.Pop();
+        ++moved;
+    }
+
+    while ((size = ikcp_peeksize(m_kcp)) >= 0)
+    {
+        if (size > m_recvRing.GetMaxRecord())
+        {
+            ikcp_recv(m_kcp, NULL, size);
+            ++m_dropped;
+            continue;
+        }
+
+        char* p = m_recvRing.Reserve(size);
+        if (NULL == p)
+        {
+            // Recv signals once it has made room; check again in case it
+            // did before seeing the flag
+            m_recvBlocked = 1;
+            KCP_BARRIER();
+            p = m_recvRing.Reserve(size);
+            if (NULL == p)
+            {
+                break;
+            }
+            m_recvBlocked = 0;
+        }
+
+        ikcp_recv(m_kcp, p, size);
+        if (m_recvRing.Commit(size))
+        {
+            Signal(m_recvFd);
+        }
+        ++moved;
+    }
+
+    return moved;
+}
@@ -0,0 +1,232 @@
+#ifndef __KCP_HANDOFF_H__
+#define __KCP_HANDOFF_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpHandoff.h
+///
+/// @brief Message handoff between an application thread and the thread
+///        owning a kcp object.
+///
+/// A kcp object is driven by one I/O thread only. An application thread
+/// sends and receives through a KcpHandoff instead: messages go through
+/// a single producer, single consumer ring each way, without locks, and
+/// the side waiting for messages is woken by an eventfd it can poll or
+/// register in a SocketReactor.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ikcp.h"
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpSpscRing
+///
+/// Wait-free byte ring of variable sized records for one producer thread
+/// and one consumer thread. A record is a 4 byte length and the data,
+/// padded to 4 bytes, and never wraps: the room left at the end of the
+/// buffer is skipped with a marker instead.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpSpscRing
+{
+public:
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] capacity - bytes, rounded up to a power of 2
+    ////////////////////////////////////////////////////////////////////////////
+    KcpSpscRing(int capacity);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpSpscRing();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Producer: get room for a record, publish it with Commit
+    /// @param[in] size - record size
+    /// @return where to write the record, NULL if the ring is full
+    ////////////////////////////////////////////////////////////////////////////
+    char* Reserve(int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Producer: publish the record of the last Reserve
+    /// @param[in] size - record size, at most what was reserved
+    /// @return true if the ring was empty, the consumer may be waiting
+    ////////////////////////////////////////////////////////////////////////////
+    bool Commit(int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Consumer: get the oldest record, release it with Pop
+    /// @param[out] size - record size
+    /// @return the record, NULL if the ring is empty
+    ////////////////////////////////////////////////////////////////////////////
+    const char* Peek(int& size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Consumer: release the record of the last Peek
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Pop();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get the largest record which always fits an empty ring
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetMaxRecord() const
+    {
+        return (int)(m_capacity / 2) - HEADER_SIZE;
+    }
+
+private:
+
+    enum
+    {
+        HEADER_SIZE = 4,
+        /// length of the marker skipping the end of the buffer
+        WRAP = 0xffffffff,
+        CACHE_LINE = 64,
+    };
+
+    /// Forbid copy constructor
+    KcpSpscRing(const KcpSpscRing&);
+    /// Forbid assignment operator
+    KcpSpscRing& operator=(const KcpSpscRing&);
+
+    static inline IUINT32 Align(int size)
+    {
+        return (IUINT32)(HEADER_SIZE + size + 3) & ~3u;
+    }
+
+    char* m_buffer;
+    IUINT32 m_capacity;
+    IUINT32 m_mask;
+
+    /// read position, free running, written by the consumer only
+    char m_pad0[CACHE_LINE];
+    volatile IUINT32 m_head;
+
+    /// consumer: bytes skipped before the record of the last Peek
+    IUINT32 m_peekSkip;
+
+    /// write position, free running, written by the producer only
+    char m_pad1[CACHE_LINE];
+    volatile IUINT32 m_tail;
+
+    /// producer: bytes skipped before the record of the last Reserve
+    IUINT32 m_reserveSkip;
+    char m_pad2[CACHE_LINE];
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpHandoff
+///
+/// Send and receive rings of one kcp session. The application thread
+/// calls Send and Recv and waits on GetRecvFd. The I/O thread owning the
+/// kcp calls Drain when GetWakeFd is readable, after ikcp_input and
+/// before ikcp_update, so queued messages reach snd_queue by the flush.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpHandoff
+{
+public:
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] kcp - kcp object, owned by the I/O thread
+    /// @param[in] capacity - bytes of each ring, a message may take up to
+    ///            half of it
+    ////////////////////////////////////////////////////////////////////////////
+    KcpHandoff(ikcpcb* kcp, int capacity = 1 << 20);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor, closes the fds, messages still queued are dropped
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpHandoff();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Application thread: queue a message for ikcp_send
+    /// @param[in] data - message
+    /// @param[in] size - message size
+    /// @return 0 if queued, -1 if the ring is full, -2 if too large
+    ////////////////////////////////////////////////////////////////////////////
+    int Send(const char* data, int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Application thread: take a received message
+    /// @param[out] buffer - room for the message
+    /// @param[in] size - buffer size
+    /// @return message size, -1 if none, -2 if the buffer is too small,
+    ///         in which case the message stays
+    ////////////////////////////////////////////////////////////////////////////
+    int Recv(char* buffer, int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief I/O thread: move queued messages to ikcp_send, as long as
+    ///        kcp holds less than two send windows, and received messages
+    ///        from ikcp_recv to the application
+    /// @return number of messages moved
+    ////////////////////////////////////////////////////////////////////////////
+    int Drain();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get fd readable while Recv may have messages
+    /// @return fd, -1 if it could not be created
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetRecvFd() const
+    {
+        return m_recvFd[0];
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get fd readable while Drain has something to do
+    /// @return fd, -1 if it could not be created
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetWakeFd() const
+    {
+        return m_wakeFd[0];
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of messages Drain dropped, refused by ikcp_send
+    ///        or too large for the receive ring
+    ////////////////////////////////////////////////////////////////////////////
+    inline IUINT32 GetDropped() const
+    {
+        return m_dropped;
+    }
+
+private:
+
+    /// Forbid copy constructor
+    KcpHandoff(const KcpHandoff&);
+    /// Forbid assignment operator
+    KcpHandoff& operator=(const KcpHandoff&);
+
+    static void OpenFd(int fd[2]);
+    static void CloseFd(int fd[2]);
+    static void Signal(const int fd[2]);
+    static void Clear(const int fd[2]);
+
+    ikcpcb* m_kcp;
+
+    /// application to I/O thread
+    KcpSpscRing m_sendRing;
+
+    /// I/O thread to application
+    KcpSpscRing m_recvRing;
+
+    /// read and write end of the wakeups, the same eventfd twice
+    int m_wakeFd[2];
+    int m_recvFd[2];
+
+    /// set by Drain when m_recvRing is full, Recv wakes it once there
+    /// is room again
+    volatile int m_recvBlocked;
+
+    IUINT32 m_dropped;
+};
+
+
+#endif // __KCP_HANDOFF_H__
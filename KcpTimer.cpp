@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpTimer.cpp
+///
+/// @brief Timer wheel scheduling ikcp_update for many kcp objects.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+
+#include "KcpTimer.h"
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpTimerWheel::KcpTimerWheel(IUINT32 now):
+m_now(now),
+m_count(0)
+{
+    for (int i = 0; i < ROOT_SIZE; i++)
+    {
+        iqueue_init(&m_root[i]);
+    }
+
+    for (int n = 0; n < LEVELS; n++)
+    {
+        for (int i = 0; i < LEVEL_SIZE; i++)
+        {
+            iqueue_init(&m_levels[n][i]);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+KcpTimerWheel::~KcpTimerWheel()
+{
+}
+
+//------------------------------------------------------------------------------
+// Put a handle in the bucket of 'expires'.
+//------------------------------------------------------------------------------
+void KcpTimerWheel::Insert(Handle& handle, IUINT32 expires)
+{
+    IUINT32 delta = expires - m_now;
+    struct IQUEUEHEAD* bucket;
+
+    // already due, run on the next tick
+    if ((IINT32)delta < 0)
+    {
+        expires = m_now;
+        delta = 0;
+    }
+
+    if (delta < (IUINT32)ROOT_SIZE)
+    {
+        bucket = &m_root[expires & ROOT_MASK];
+    }
+    else
+    {
+        int level = 0;
+        int shift = ROOT_BITS;
+
+        while ((level < LEVELS - 1) && (delta >= ((IUINT32)1 << (shift + LEVEL_BITS))))
+        {
+            ++level;
+            shift += LEVEL_BITS;
+        }
+
+        bucket = &m_levels[level][(expires >> shift) & LEVEL_MASK];
+    }
+
+    handle.expires = expires;
+    iqueue_add_tail(&handle.node, bucket);
+}
+
+//------------------------------------------------------------------------------
+// Move one bucket of a level down the wheel, returns true if the level
+// wrapped and the next one must cascade too.
+//------------------------------------------------------------------------------
+bool KcpTimerWheel::Cascade(int level, int index)
+{
+    struct IQUEUEHEAD list;
+
+    iqueue_init(&list);
+    iqueue_splice_init(&m_levels[level][index], &list);
+
+    while (!iqueue_is_empty(&list))
+    {
+        Handle* handle = iqueue_entry(list.next, Handle, node);
+        iqueue_del(&handle->node);
+        Insert(*handle, handle->expires);
+    }
+
+    return (0 == index);
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void KcpTimerWheel::Add(Handle& handle, ikcpcb* kcp, void* user)
+{
+    handle.kcp = kcp;
+    handle.user = user;
+    handle.pending = true;
+    iqueue_init(&handle.node);
+
+    Insert(handle, ikcp_check(kcp, m_now));
+    ++m_count;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void KcpTimerWheel::Remove(Handle& handle)
+{
+    if (!handle.pending)
+    {
+        return;
+    }
+
+    iqueue_del_init(&handle.node);
+    handle.pending = false;
+    --m_count;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void KcpTimerWheel::Rearm(Handle& handle)
+{
+    if (!handle.pending)
+    {
+        return;
+    }
+
+    IUINT32 expires = ikcp_check(handle.kcp, m_now);
+
+    // only ever earlier: a later answer means the current slot is harmless
+    if ((IINT32)(expires - handle.expires) < 0)
+    {
+        iqueue_del(&handle.node);
+        Insert(handle, expires);
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpTimerWheel::Input(Handle& handle, const char* data, long size)
+{
+    int rc = ikcp_input(handle.kcp, data, size);
+    Rearm(handle);
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpTimerWheel::Send(Handle& handle, const char* data, int size)
+{
+    int rc = ikcp_send(handle.kcp, data, size);
+    Rearm(handle);
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpTimerWheel::Run(IUINT32 now)
+{
+    int count = 0;
+
+    while ((IINT32)(now - m_now) >= 0)
+    {
+        int index = m_now & ROOT_MASK;
+
+        if (0 == index)
+        {
+            int shift = ROOT_BITS;
+            for (int level = 0; level < LEVELS; level++)
+            {
+                if (!Cascade(level, (m_now >> shift) & LEVEL_MASK))
+                {
+                    break;
+                }
+                shift += LEVEL_BITS;
+            }
+        }
+
+        // detach first, updates may rearm other handles into this bucket
+        struct IQUEUEHEAD list;
+        iqueue_init(&list);
+        iqueue_splice_init(&m_root[index], &list);
+
+        ++m_now;
+
+        while (!iqueue_is_empty(&list))
+        {
+            Handle* handle = iqueue_entry(list.next, Handle, node);
+            iqueue_del(&handle->node);
+
+            ikcp_update(handle->kcp, now);
+
+            IUINT32 expires = ikcp_check(handle->kcp, now);
+            if ((IINT32)(expires - now) <= 0)
+            {
+                expires = now + 1;
+            }
+            Insert(*handle, expires);
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int KcpTimerWheel::NextTimeout(IUINT32 now, int maxWait) const
+{
+    int behind = (int)(IINT32)(now - m_now);
+    if (behind >= 0)
+    {
+        return 0;
+    }
+
+    // scan the root buckets ahead, coarser levels only need a cascade
+    // at the next root wrap, which the scan stops at. bucket i runs at
+    // m_now + i, that is i - behind from now.
+    for (int i = 0; (i < ROOT_SIZE) && (i - behind < maxWait); i++)
+    {
+        int index = (m_now + i) & ROOT_MASK;
+        if (((i > 0) && (0 == index)) || !iqueue_is_empty(&m_root[index]))
+        {
+            return i - behind;
+        }
+    }
+
+    return maxWait;
+}
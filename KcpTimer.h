@@ -0,0 +1,148 @@
+#ifndef __KCP_TIMER_H__
+#define __KCP_TIMER_H__
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @file KcpTimer.h
+///
+/// @brief Timer wheel scheduling ikcp_update for many kcp objects.
+///
+/// Each kcp sits in the wheel bucket of the time ikcp_check asks for, and
+/// only due kcp objects are updated. An idle kcp is still due once per
+/// interval, when its next flush comes, but not on the ticks in between.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ikcp.h"
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class KcpTimerWheel
+///
+/// Hierarchical wheel with 1 ms ticks: 256 buckets for the next 256 ms,
+/// then four levels of 64 buckets cascading down as time passes.
+///
+////////////////////////////////////////////////////////////////////////////////
+class KcpTimerWheel
+{
+public:
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Per kcp schedule entry, owned by the caller
+    ////////////////////////////////////////////////////////////////////////////
+    struct Handle
+    {
+        struct IQUEUEHEAD node;
+        ikcpcb* kcp;
+        IUINT32 expires;
+        bool pending;
+        void* user;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] now - current kcp clock in milliseconds
+    ////////////////////////////////////////////////////////////////////////////
+    KcpTimerWheel(IUINT32 now);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor, leaves the handles alone: pending ones still point
+    ///        into the freed buckets, so Remove them first or drop them
+    ////////////////////////////////////////////////////////////////////////////
+    ~KcpTimerWheel();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Start scheduling a kcp
+    /// @param[in] handle - entry for the kcp, must outlive its scheduling
+    /// @param[in] kcp - kcp object
+    /// @param[in] user - user pointer kept in the handle
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Add(Handle& handle, ikcpcb* kcp, void* user = NULL);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Stop scheduling, call it before ikcp_release
+    /// @param[in] handle - scheduled entry
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Remove(Handle& handle);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Move the kcp earlier if ikcp_check wants it sooner, call it
+    ///        after ikcp_input, ikcp_send or any setting change
+    /// @param[in] handle - scheduled entry
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Rearm(Handle& handle);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief ikcp_input then Rearm
+    /// @return what ikcp_input returns
+    ////////////////////////////////////////////////////////////////////////////
+    int Input(Handle& handle, const char* data, long size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief ikcp_send then Rearm
+    /// @return what ikcp_send returns
+    ////////////////////////////////////////////////////////////////////////////
+    int Send(Handle& handle, const char* data, int size);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Update every kcp due up to now and schedule it again
+    /// @param[in] now - current kcp clock in milliseconds
+    /// @return number of kcp objects updated
+    ////////////////////////////////////////////////////////////////////////////
+    int Run(IUINT32 now);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Time until Run has something to do
+    /// @param[in] now - current kcp clock in milliseconds
+    /// @param[in] maxWait - upper bound of the answer
+    /// @return wait time in milliseconds, at most maxWait
+    ////////////////////////////////////////////////////////////////////////////
+    int NextTimeout(IUINT32 now, int maxWait) const;
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get number of scheduled kcp objects
+    /// @return count
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetCount() const
+    {
+        return m_count;
+    }
+
+private:
+
+    enum
+    {
+        ROOT_BITS = 8,
+        ROOT_SIZE = 1 << ROOT_BITS,
+        ROOT_MASK = ROOT_SIZE - 1,
+        LEVEL_BITS = 6,
+        LEVEL_SIZE = 1 << LEVEL_BITS,
+        LEVEL_MASK = LEVEL_SIZE - 1,
+        LEVELS = 4,
+    };
+
+    /// Forbid copy constructor
+    KcpTimerWheel(const KcpTimerWheel&);
+    /// Forbid assignment operator
+    KcpTimerWheel& operator=(const KcpTimerWheel&);
+
+    void Insert(Handle& handle, IUINT32 expires);
+    bool Cascade(int level, int index);
+
+    /// time of the next tick to run
+    IUINT32 m_now;
+
+    /// scheduled handles
+    int m_count;
+
+    /// buckets for the next ROOT_SIZE ticks
+    struct IQUEUEHEAD m_root[ROOT_SIZE];
+
+    /// coarser buckets, level n covers ROOT_BITS + (n+1) * LEVEL_BITS bits
+    struct IQUEUEHEAD m_levels[LEVELS][LEVEL_SIZE];
+};
+
+
+#endif // __KCP_TIMER_H__
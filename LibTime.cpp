@@ -75,6 +75,18 @@ uint64_t GetCurrTimeAsMilliSecond(void)
     return TimeToMilliSecond(time);  
 }
 
+uint64_t GetCurrTimeAsMicroSecond(void)
+{
+    struct timeval time;
+
+    if (gettimeofday(&time, NULL))
+    {
+        return 0;
+    }
+
+    return TimeToMicroSecond(time);
+}
+
 double TimeToDouble(const struct timeval& time)
 {
     return (time.tv_sec + (double)time.tv_usec / MICRO_SECOND);    
@@ -90,6 +102,11 @@ uint64_t TimeToMilliSecond(const struct timeval& time)
     return (((uint64_t)time.tv_sec) * MILLI_SECOND  + ((uint64_t)time.tv_usec) / MILLI_SECOND);    
 }
 
+uint64_t TimeToMicroSecond(const struct timeval& time)
+{
+    return (((uint64_t)time.tv_sec) * MICRO_SECOND + ((uint64_t)time.tv_usec));
+}
+
 std::string TimeToDateString(time_t tt)
 {
     struct tm *times = localtime(&tt);
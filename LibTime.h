@@ -21,10 +21,12 @@ extern double GetCurrTimeAsDouble(void);
 extern uint64_t GetCurrTimeAsLong(void);
 extern uint64_t GetSysTimeAsMilliSecond();
 extern uint64_t GetCurrTimeAsMilliSecond(void);
+extern uint64_t GetCurrTimeAsMicroSecond(void);
 
 extern double TimeToDouble(const struct timeval& time);
 extern uint64_t TimeToLong(const struct timeval& time);
 extern uint64_t TimeToMilliSecond(const struct timeval& time);
+extern uint64_t TimeToMicroSecond(const struct timeval& time);
 extern std::string TimeToDateString(time_t tt);
 extern std::string MilliTimeToDateString(uint64_t tt);
 extern std::string MilliTimeToDateString2(uint64_t tt);
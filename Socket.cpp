@@ -20,6 +20,20 @@
 
 #include "Socket.h"
 #include "LibLog.h"
+#include "LibTime.h"
+
+// recvmmsg appeared in glibc 2.12, sendmmsg in glibc 2.14
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 12)))
+#define HAVE_RECVMMSG
+#endif
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 14)))
+#define HAVE_SENDMMSG
+#endif
+
+// SO_REUSEPORT appeared in linux 3.9, older headers lack it
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
 
 
 //------------------------------------------------------------------------
@@ -436,7 +450,8 @@ VSocket::VSocket(int addressFamily, int type, int protocol):
     m_sockFd(INVALID_FD),
     m_addressFamily(addressFamily),
     m_type(type),
-    m_protocol(protocol)
+    m_protocol(protocol),
+    m_isReusePort(false)
 {
 }
 
@@ -486,6 +501,18 @@ int VSocket::Create(const in_port_t port, const in_addr_t ipAddr, bool isReuseAd
         }
     }
 
+    if (m_isReusePort)
+    {
+        // every socket of the group must set it before bind
+        int yes = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)
+        {
+            PERROR("Failed to reuse port of socket %d", fd);
+            ::close(fd);
+            return INVALID_FD;
+        }
+    }
+
     // bind socket
     if (::bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
     {
@@ -617,6 +644,109 @@ int VSocket::Send(const void* data, int size, const SocketAddress& to)
     return rc;
 }
 
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int VSocket::SendV(const struct iovec* iov, int count, const SocketAddress& to)
+{
+    if ((NULL == iov) || (count <= 0))
+    {
+        return -1;
+    }
+    
+    if (INVALID_FD == m_sockFd)
+    {
+        Create();
+    }
+
+    if (INVALID_FD == m_sockFd)
+    {
+        return -1;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)(const struct sockaddr*)to;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = count;
+
+    int rc = 0;
+    do
+    {
+        rc = ::sendmsg(m_sockFd, &msg, 0);
+    }
+    while ((rc < 0) && (EINTR == errno));
+    
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int VSocket::SendBatch(const struct iovec* data, const SocketAddress* const* to, int count)
+{
+    if ((NULL == data) || (NULL == to) || (count <= 0))
+    {
+        return -1;
+    }
+    
+    if (INVALID_FD == m_sockFd)
+    {
+        Create();
+    }
+
+    if (INVALID_FD == m_sockFd)
+    {
+        return -1;
+    }
+
+    int sent = 0;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[SEND_BATCH_MAX];
+    while (sent < count)
+    {
+        int n = count - sent;
+        if (n > SEND_BATCH_MAX)
+        {
+            n = SEND_BATCH_MAX;
+        }
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * n);
+        for (int i = 0; i < n; i++)
+        {
+            msgs[i].msg_hdr.msg_name = (void*)(const struct sockaddr*)*to[sent + i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = (struct iovec*)&data[sent + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int rc = 0;
+        do
+        {
+            rc = ::sendmmsg(m_sockFd, msgs, n, 0);
+        }
+        while ((rc < 0) && (EINTR == errno));
+
+        if (rc <= 0)
+        {
+            break;
+        }
+        sent += rc;
+    }
+#else
+    for (; sent < count; sent++)
+    {
+        if (Send(data[sent].iov_base, data[sent].iov_len, *to[sent]) < 0)
+        {
+            break;
+        }
+    }
+#endif
+
+    return (sent > 0) ? sent : -1;
+}
+
 //------------------------------------------------------------------------------
 // This is a public API.
 //------------------------------------------------------------------------------
@@ -653,6 +783,98 @@ int VSocket::Recv(void* data, int size, SocketAddress& from)
     return rc;
 }
 
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int VSocket::RecvBatch(const struct iovec* data, int* sizes, SocketAddress* from, int count)
+{
+    if ((NULL == data) || (NULL == sizes) || (NULL == from) || (count <= 0))
+    {
+        return -1;
+    }
+    
+    if (INVALID_FD == m_sockFd)
+    {
+        Create();
+    }
+
+    if (INVALID_FD == m_sockFd)
+    {
+        return -1;
+    }
+
+    int received = 0;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[RECV_BATCH_MAX];
+    while (received < count)
+    {
+        int n = count - received;
+        if (n > RECV_BATCH_MAX)
+        {
+            n = RECV_BATCH_MAX;
+        }
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * n);
+        for (int i = 0; i < n; i++)
+        {
+            msgs[i].msg_hdr.msg_name = (struct sockaddr*)from[received + i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = (struct iovec*)&data[received + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // wait for the first datagram only, never once something arrived
+        int rc = 0;
+        do
+        {
+            rc = ::recvmmsg(m_sockFd, msgs, n, (received > 0) ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        }
+        while ((rc < 0) && (EINTR == errno));
+
+        if (rc <= 0)
+        {
+            if ((received == 0) && (rc < 0) && (EAGAIN != errno))
+            {
+                return -1;
+            }
+            break;
+        }
+
+        for (int i = 0; i < rc; i++)
+        {
+            sizes[received + i] = msgs[i].msg_len;
+        }
+        received += rc;
+
+        if (rc < n)
+        {
+            break;
+        }
+    }
+#else
+    for (; received < count; received++)
+    {
+        if ((received > 0) && !WaitInput(0))
+        {
+            break;
+        }
+
+        int rc = Recv(data[received].iov_base, data[received].iov_len, from[received]);
+        if (rc <= 0)
+        {
+            if ((received == 0) && (rc < 0))
+            {
+                return -1;
+            }
+            break;
+        }
+        sizes[received] = rc;
+    }
+#endif
+
+    return received;
+}
+
 //------------------------------------------------------------------------------
 // This is a public API.
 //------------------------------------------------------------------------------
@@ -1186,6 +1408,315 @@ int TcpServer::Accept(TcpClient& tcpClient)
     return 0;
 }
 
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+DatagramRing::DatagramRing(int count, int size):
+m_count(count),
+m_received(0)
+{
+    m_storage = new char[count * size];
+    m_iov = new struct iovec[count];
+    m_sizes = new int[count];
+    m_from = new SocketAddress[count];
+
+    for (int i = 0; i < count; i++)
+    {
+        m_iov[i].iov_base = m_storage + i * size;
+        m_iov[i].iov_len = size;
+        m_sizes[i] = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+DatagramRing::~DatagramRing()
+{
+    delete[] m_storage;
+    delete[] m_iov;
+    delete[] m_sizes;
+    delete[] m_from;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int DatagramRing::Recv(VSocket& sock)
+{
+    int rc = sock.RecvBatch(m_iov, m_sizes, m_from, m_count);
+    m_received = (rc > 0) ? rc : 0;
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+SocketReactor::SocketReactor(int maxEvents):
+m_epollFd(-1),
+m_events(maxEvents > 0 ? maxEvents : 1),
+m_nextTimerId(0),
+m_running(false)
+{
+    m_epollFd = epoll_create(1024);
+    if (m_epollFd < 0)
+    {
+        PERROR("Failed to create epoll");
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+SocketReactor::~SocketReactor()
+{
+    for (FdMap::iterator it = m_fds.begin(); it != m_fds.end(); ++it)
+    {
+        if (it->second.owned)
+        {
+            delete it->second.handler;
+        }
+    }
+    for (size_t i = 0; i < m_garbage.size(); i++)
+    {
+        delete m_garbage[i];
+    }
+
+    if (m_epollFd >= 0)
+    {
+        ::close(m_epollFd);
+    }
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::Add(int fd, int events, Handler* handler)
+{
+    if ((fd < 0) || (NULL == handler) || (m_epollFd < 0))
+    {
+        return -1;
+    }
+
+    if (m_fds.find(fd) != m_fds.end())
+    {
+        return -1;
+    }
+
+    // edge-triggered needs reads and writes to stop at EAGAIN
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & (EVENT_IN | EVENT_OUT)) | EPOLLET;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        PERROR("Failed to add fd %d to epoll %d", fd, m_epollFd);
+        return -1;
+    }
+
+    FdEntry& entry = m_fds[fd];
+    entry.handler = handler;
+    entry.owned = false;
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::Modify(int fd, int events)
+{
+    if (m_fds.find(fd) == m_fds.end())
+    {
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & (EVENT_IN | EVENT_OUT)) | EPOLLET;
+    ev.data.fd = fd;
+
+    return (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev) < 0) ? -1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::Remove(int fd)
+{
+    FdMap::iterator it = m_fds.find(fd);
+    if (it == m_fds.end())
+    {
+        return -1;
+    }
+
+    // the kernel needs a non-null event pointer before linux 2.6.9
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, &ev);
+
+    if (it->second.owned)
+    {
+        m_garbage.push_back(it->second.handler);
+    }
+    m_fds.erase(it);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::AddTimer(int waitMilliSec, Handler* handler)
+{
+    if (waitMilliSec < 0)
+    {
+        waitMilliSec = 0;
+    }
+
+    // ids stay positive and skip ids still pending after a wrap
+    do
+    {
+        if (++m_nextTimerId <= 0)
+        {
+            m_nextTimerId = 1;
+        }
+    }
+    while (m_timerIds.find(m_nextTimerId) != m_timerIds.end());
+
+    TimerEntry entry;
+    entry.id = m_nextTimerId;
+    entry.handler = handler;
+
+    uint64_t when = GetCurrTimeAsLong() + waitMilliSec;
+    m_timerIds[entry.id] = m_timers.insert(std::make_pair(when, entry));
+
+    return entry.id;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::CancelTimer(int id)
+{
+    TimerIdMap::iterator it = m_timerIds.find(id);
+    if (it == m_timerIds.end())
+    {
+        return -1;
+    }
+
+    m_timers.erase(it->second);
+    m_timerIds.erase(it);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// Call the handlers of expired timers, returns the number called.
+//------------------------------------------------------------------------------
+int SocketReactor::RunTimers()
+{
+    uint64_t now = GetCurrTimeAsLong();
+    int count = 0;
+
+    // handlers may add or cancel timers, so take one at a time
+    while (!m_timers.empty() && (m_timers.begin()->first <= now))
+    {
+        TimerEntry entry = m_timers.begin()->second;
+        m_timers.erase(m_timers.begin());
+        m_timerIds.erase(entry.id);
+
+        entry.handler->OnEvent(entry.id, EVENT_TIMER);
+        ++count;
+    }
+
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+int SocketReactor::RunOnce(int waitMilliSec)
+{
+    if (m_epollFd < 0)
+    {
+        return -1;
+    }
+
+    if (!m_timers.empty())
+    {
+        uint64_t now = GetCurrTimeAsLong();
+        uint64_t when = m_timers.begin()->first;
+        int timeout = (when > now) ? (int)(when - now) : 0;
+
+        if ((WAIT_FOREVER == waitMilliSec) || (timeout < waitMilliSec))
+        {
+            waitMilliSec = timeout;
+        }
+    }
+
+    int rc = 0;
+    do
+    {
+        rc = epoll_wait(m_epollFd, &m_events[0], (int)m_events.size(), waitMilliSec);
+    }
+    while ((rc < 0) && (EINTR == errno));
+
+    if (rc < 0)
+    {
+        PERROR("Failed to wait on epoll %d", m_epollFd);
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < rc; i++)
+    {
+        int fd = m_events[i].data.fd;
+
+        // an earlier handler of this round may have removed it
+        FdMap::iterator it = m_fds.find(fd);
+        if (it == m_fds.end())
+        {
+            continue;
+        }
+
+        it->second.handler->OnEvent(fd, m_events[i].events);
+        ++count;
+    }
+
+    count += RunTimers();
+
+    for (size_t i = 0; i < m_garbage.size(); i++)
+    {
+        delete m_garbage[i];
+    }
+    m_garbage.clear();
+
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// This is a public API.
+//------------------------------------------------------------------------------
+void SocketReactor::Run()
+{
+    m_running = true;
+    while (m_running)
+    {
+        if (RunOnce() < 0)
+        {
+            break;
+        }
+    }
+}
+
 int GetLocalIpAddrList(IfIpAddrList& list)
 {
     int fd = socket(AF_INET, SOCK_DGRAM, 0);
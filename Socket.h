@@ -12,6 +12,7 @@
 
 #include <string>                 // std::string
 #include <sys/socket.h>           // inet_ntoa
+#include <sys/uio.h>              // struct iovec
 #include <netinet/in.h>           // inet_ntoa, in_addr_t
 #include <arpa/inet.h>            // inet_ntoa
 #include <netdb.h>                // gethostbyname
@@ -22,6 +23,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <list>
+#include <vector>
+#include <sys/epoll.h>
 
 #include "Type.hpp"
 #ifdef USE_NDK_ENV
@@ -172,6 +175,24 @@ public:
     /// @return size of data sent if successful, otherwise -1
     ////////////////////////////////////////////////////////////////////////////
     virtual int Send(const void* data, int size, const SocketAddress& to);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Send one datagram gathered from several buffers
+    /// @param[in] iov - buffers to be sent, in order
+    /// @param[in] count - number of buffers
+    /// @param[in] to - the address where data is sent to.
+    /// @return size of data sent if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    virtual int SendV(const struct iovec* iov, int count, const SocketAddress& to);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Send several datagrams, in one system call where supported
+    /// @param[in] data - one buffer per datagram
+    /// @param[in] to - destination of each datagram
+    /// @param[in] count - number of datagrams
+    /// @return number of datagrams sent if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    virtual int SendBatch(const struct iovec* data, const SocketAddress* const* to, int count);
     
     ////////////////////////////////////////////////////////////////////////////
     /// @brief Receive data from socket
@@ -182,6 +203,19 @@ public:
     ////////////////////////////////////////////////////////////////////////////
     virtual int Recv(void* data, int size, SocketAddress& from);
 
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Receive several datagrams, in one system call where supported.
+    ///        Waits for the first datagram on a blocking socket like Recv,
+    ///        never for the ones after it
+    /// @param[in] data - one buffer per datagram
+    /// @param[out] sizes - size of each datagram received
+    /// @param[out] from - the address each datagram is from
+    /// @param[in] count - number of buffers
+    /// @return number of datagrams received, 0 if none is pending on a
+    ///         non-blocking socket, -1 on error
+    ////////////////////////////////////////////////////////////////////////////
+    virtual int RecvBatch(const struct iovec* data, int* sizes, SocketAddress* from, int count);
+
     ////////////////////////////////////////////////////////////////////////////
     /// @brief Wait for input and output
     /// @param[in] waitMilliSec - wait time im milliseconds
@@ -235,6 +269,17 @@ public:
     ////////////////////////////////////////////////////////////////////////////
     virtual void SetTxBufSize(int size);
 
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Let several sockets bind the same port, the kernel spreads
+    ///        datagrams over them by peer. Takes effect at the next Create.
+    /// @param[in] isReusePort - if SO_REUSEPORT is set before bind
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    inline void SetReusePort(bool isReusePort)
+    {
+        m_isReusePort = isReusePort;
+    }
+
     ////////////////////////////////////////////////////////////////////////////
     /// @brief Get address family
     /// @return address family
@@ -311,6 +356,10 @@ public:
     {
         /// Invalid socket fd value
         INVALID_FD = -1,
+        /// Datagrams handed to one sendmmsg call by SendBatch
+        SEND_BATCH_MAX = 64,
+        /// Datagrams taken by one recvmmsg call in RecvBatch
+        RECV_BATCH_MAX = 64,
     };
 
 
@@ -340,6 +389,9 @@ private:
     /// socket address
     SocketAddress m_sockAddr;
     std::string m_addrString;
+
+    /// SO_REUSEPORT at Create
+    bool m_isReusePort;
     
 };
 
@@ -406,6 +458,280 @@ public:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class DatagramRing
+///
+/// Preallocated datagram slots refilled by VSocket::RecvBatch. The slots
+/// are reused by every Recv, so data must be consumed before the next one.
+///
+////////////////////////////////////////////////////////////////////////////////
+class DatagramRing
+{
+public:
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] count - number of slots
+    /// @param[in] size - slot size, the largest datagram accepted
+    ////////////////////////////////////////////////////////////////////////////
+    DatagramRing(int count = VSocket::RECV_BATCH_MAX, int size = 2048);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~DatagramRing();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Receive datagrams into the slots, see VSocket::RecvBatch
+    /// @param[in] sock - socket to read from
+    /// @return number of datagrams received, 0 if none is pending on a
+    ///         non-blocking socket, -1 on error
+    ////////////////////////////////////////////////////////////////////////////
+    int Recv(VSocket& sock);
+
+    int Capacity() const { return m_count; }
+    int Count() const { return m_received; }
+    const char* Data(int i) const { return (const char*)m_iov[i].iov_base; }
+    int Size(int i) const { return m_sizes[i]; }
+    const SocketAddress& From(int i) const { return m_from[i]; }
+
+private:
+
+    /// Forbid copy constructor
+    DatagramRing(const DatagramRing&);
+    /// Forbid assignment operator
+    DatagramRing& operator=(const DatagramRing&);
+
+    /// number of slots
+    int m_count;
+
+    /// datagrams received by the last Recv
+    int m_received;
+
+    /// slot storage
+    char* m_storage;
+    struct iovec* m_iov;
+    int* m_sizes;
+    SocketAddress* m_from;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+///
+/// @class SocketReactor
+///
+/// epoll event loop for many sockets, with one-shot timers sharing the
+/// same wait. fds are registered edge-triggered and switched to
+/// non-blocking, so a handler must read or write until EAGAIN.
+///
+////////////////////////////////////////////////////////////////////////////////
+class SocketReactor
+{
+public:
+
+    enum
+    {
+        /// fd readable
+        EVENT_IN = EPOLLIN,
+        /// fd writable
+        EVENT_OUT = EPOLLOUT,
+        /// error or hang up, always reported
+        EVENT_ERR = EPOLLERR | EPOLLHUP,
+        /// timer expired, passed with the timer id instead of a fd
+        EVENT_TIMER = 0x40000000,
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Event handler, called with (fd, events) or (timer id, EVENT_TIMER)
+    ////////////////////////////////////////////////////////////////////////////
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+        virtual void OnEvent(int fd, int event) = 0;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Adapter for a member function like TUdpMsg::SocketHandler
+    ////////////////////////////////////////////////////////////////////////////
+    template <class T>
+    class TMemberHandler : public Handler
+    {
+    public:
+        typedef void (T::*Func)(int fd, int event);
+
+        TMemberHandler(T* object, Func func):
+        m_object(object),
+        m_func(func)
+        {
+        }
+
+        virtual void OnEvent(int fd, int event)
+        {
+            (m_object->*m_func)(fd, event);
+        }
+
+    private:
+        T* m_object;
+        Func m_func;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Constructor
+    /// @param[in] maxEvents - events taken by one epoll_wait
+    ////////////////////////////////////////////////////////////////////////////
+    SocketReactor(int maxEvents = 256);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Destructor
+    ////////////////////////////////////////////////////////////////////////////
+    ~SocketReactor();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Register a fd
+    /// @param[in] fd - fd to watch
+    /// @param[in] events - EVENT_IN and/or EVENT_OUT
+    /// @param[in] handler - handler, not owned
+    /// @return 0 if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    int Add(int fd, int events, Handler* handler);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Register a fd handled by a member function
+    /// @param[in] fd - fd to watch
+    /// @param[in] events - EVENT_IN and/or EVENT_OUT
+    /// @param[in] object - object the handler is called on
+    /// @param[in] func - member function, e.g. &TUdpMsg<T>::SocketHandler
+    /// @return 0 if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    template <class T>
+    int Add(int fd, int events, T* object, void (T::*func)(int fd, int event))
+    {
+        Handler* handler = new(std::nothrow) TMemberHandler<T>(object, func);
+        if (NULL == handler)
+        {
+            return -1;
+        }
+
+        if (Add(fd, events, handler) < 0)
+        {
+            delete handler;
+            return -1;
+        }
+
+        m_fds[fd].owned = true;
+        return 0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Change the events watched on a registered fd
+    /// @param[in] fd - registered fd
+    /// @param[in] events - EVENT_IN and/or EVENT_OUT
+    /// @return 0 if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    int Modify(int fd, int events);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Unregister a fd, safe to call from a handler
+    /// @param[in] fd - registered fd
+    /// @return 0 if successful, otherwise -1
+    ////////////////////////////////////////////////////////////////////////////
+    int Remove(int fd);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Start a one-shot timer
+    /// @param[in] waitMilliSec - delay from now in milliseconds
+    /// @param[in] handler - handler, not owned
+    /// @return timer id (>0)
+    ////////////////////////////////////////////////////////////////////////////
+    int AddTimer(int waitMilliSec, Handler* handler);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Stop a timer which has not expired yet
+    /// @param[in] id - timer id
+    /// @return 0 if successful, -1 if unknown or already expired
+    ////////////////////////////////////////////////////////////////////////////
+    int CancelTimer(int id);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Wait for events or the next timer, and dispatch them
+    /// @param[in] waitMilliSec - max wait time. If WAIT_FOREVER, only the
+    ///                           next timer bounds the wait.
+    /// @return number of handlers called, -1 on error
+    ////////////////////////////////////////////////////////////////////////////
+    int RunOnce(int waitMilliSec = WAIT_FOREVER);
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Dispatch until Stop is called
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    void Run();
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Make Run return after the current dispatch
+    /// @return none
+    ////////////////////////////////////////////////////////////////////////////
+    inline void Stop()
+    {
+        m_running = false;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// @brief Get epoll fd
+    /// @return epoll fd
+    ////////////////////////////////////////////////////////////////////////////
+    inline int GetFd() const
+    {
+        return m_epollFd;
+    }
+
+private:
+
+    struct FdEntry
+    {
+        Handler* handler;
+        bool owned;
+    };
+
+    struct TimerEntry
+    {
+        int id;
+        Handler* handler;
+    };
+
+    typedef std::map<int, FdEntry> FdMap;
+    typedef std::multimap<uint64_t, TimerEntry> TimerMap;
+    typedef std::map<int, TimerMap::iterator> TimerIdMap;
+
+    /// Forbid copy constructor
+    SocketReactor(const SocketReactor&);
+    /// Forbid assignment operator
+    SocketReactor& operator=(const SocketReactor&);
+
+    int RunTimers();
+
+    /// epoll fd
+    int m_epollFd;
+
+    /// events buffer for epoll_wait
+    std::vector<struct epoll_event> m_events;
+
+    /// registered fds
+    FdMap m_fds;
+
+    /// owned handlers of removed fds, deleted after the dispatch
+    std::vector<Handler*> m_garbage;
+
+    /// timers by deadline, and by id for cancel
+    TimerMap m_timers;
+    TimerIdMap m_timerIds;
+    int m_nextTimerId;
+
+    bool m_running;
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 ///
 /// @class VTcpSocket
@@ -799,18 +1125,34 @@ public:
     }
     
     ////////////////////////////////////////////////////////////////////////////
-    /// @brief Get socket fd
-    /// @return socket fd
+    /// @brief Receive and dispatch every pending msg
+    /// @param[in] fd - unused
+    /// @param[in] event - unused
+    /// @return none
     ////////////////////////////////////////////////////////////////////////////
     void SocketHandler(int fd, int event)
     {
         (void)fd;       // unused
         (void)event;    // unused
         
-        int rc = RecvMsg();
-        if (rc > 0)
+        // a SocketReactor reports each readiness edge once, so take every
+        // datagram queued before the wait, not just the first
+        for (;;)
         {
-            ProcMsg();
+            int rc = RecvMsg();
+            if (rc > 0)
+            {
+                ProcMsg();
+            }
+            else if (rc < 0)
+            {
+                break;
+            }
+
+            if (!m_udp.WaitInput(0))
+            {
+                break;
+            }
         }
     }
 
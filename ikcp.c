@@ -17,6 +17,30 @@
 #include <string.h>
 #include <stdarg.h>
 
+#if defined(__SSE2__) && !IWORDS_BIG_ENDIAN
+#include <emmintrin.h>
+#define IKCP_SSE2 1
+#endif
+
+#if defined(__GNUC__)
+#define IKCP_BARRIER() __sync_synchronize()
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define IKCP_BARRIER() _ReadWriteBarrier()
+#else
+#define IKCP_BARRIER()
+#endif
+
+// single writer side of kcp->stats_seq: the reader keeps full barriers,
+// the writer only has to order its own stores
+#if defined(__GNUC__) && defined(__ATOMIC_RELEASE)
+#define IKCP_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define IKCP_WMB() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#define IKCP_STORE_RELEASE(p, v) do { IKCP_BARRIER(); *(p) = (v); } while (0)
+#define IKCP_WMB() IKCP_BARRIER()
+#endif
+
 
 
 //=====================================================================
@@ -30,6 +54,10 @@ const IUINT32 IKCP_CMD_PUSH = 81;		// cmd: push data
 const IUINT32 IKCP_CMD_ACK  = 82;		// cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;		// cmd: window size (tell)
+const IUINT32 IKCP_CMD_SACK = 85;		// cmd: selective ack bitmap
+const IUINT32 IKCP_FRG_SACK = 0x80;		// frg of non-push: sack capable
+const IUINT32 IKCP_FRG_WSCALE = 0x0f;	// frg of non-push: window shift
+const IUINT32 IKCP_WSCALE_MAX = 14;
 const IUINT32 IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
 const IUINT32 IKCP_WND_SND = 32;
@@ -43,6 +71,9 @@ const IUINT32 IKCP_THRESH_INIT = 2;
 const IUINT32 IKCP_THRESH_MIN = 2;
 const IUINT32 IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
 const IUINT32 IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
+const IUINT32 IKCP_RESYNC = 10000;		// ts_flush further off is reset
+const IUINT32 IKCP_INTERVAL_MIN = 10;	// in ticks, sub-millisec with IKCP_CLOCK_US
+const IUINT32 IKCP_INTERVAL_MAX = 5000;
 
 
 //---------------------------------------------------------------------
@@ -119,6 +150,86 @@ static inline const char *ikcp_decode32u(const char *p, IUINT32 *l)
     return p;
 }
 
+//---------------------------------------------------------------------
+// bulk header codec: the wire header is laid out like IKCPHDR, so on a
+// little endian cpu with sse2 a header moves as 16 + 8 bytes instead of
+// eight fields.
+//---------------------------------------------------------------------
+typedef struct IKCPHDR {
+    IUINT32 conv;
+    IUINT8 cmd, frg;
+    IUINT16 wnd;
+    IUINT32 ts, sn, una, len;
+} IKCPHDR;
+
+#define IKCP_HDR_BATCH 64
+
+static inline void ikcp_decode_hdr(const char *p, IKCPHDR *hdr)
+{
+#if IKCP_SSE2
+    _mm_storeu_si128((__m128i*)hdr, _mm_loadu_si128((const __m128i*)p));
+    _mm_storel_epi64((__m128i*)&hdr->una,
+        _mm_loadl_epi64((const __m128i*)(p + 16)));
+#else
+    p = ikcp_decode32u(p, &hdr->conv);
+    p = ikcp_decode8u(p, &hdr->cmd);
+    p = ikcp_decode8u(p, &hdr->frg);
+    p = ikcp_decode16u(p, &hdr->wnd);
+    p = ikcp_decode32u(p, &hdr->ts);
+    p = ikcp_decode32u(p, &hdr->sn);
+    p = ikcp_decode32u(p, &hdr->una);
+    p = ikcp_decode32u(p, &hdr->len);
+#endif
+}
+
+// decode up to 'limit' headers of a datagram in one pass, stopping at
+// the first one of another conv (*hr = -1), claiming more payload than
+// is left (-2) or carrying an unknown cmd (-3). returns the number of
+// valid headers, their payloads follow each in turn.
+static int ikcp_decode_hdrs(const char *data, long size, IUINT32 conv,
+    IKCPHDR *hdr, int limit, int *hr)
+{
+    int n;
+    for (n = 0; n < limit && size >= (long)IKCP_OVERHEAD; n++, hdr++) {
+        ikcp_decode_hdr(data, hdr);
+        size -= IKCP_OVERHEAD;
+        if ((hdr->conv != conv) | (hdr->len > (IUINT32)size) |
+            ((IUINT8)(hdr->cmd - IKCP_CMD_PUSH) > 4)) {
+            if (hdr->conv != conv) *hr = -1;
+            else if (hdr->len > (IUINT32)size) *hr = -2;
+            else *hr = -3;
+            break;
+        }
+        data += IKCP_OVERHEAD + hdr->len;
+        size -= hdr->len;
+    }
+    return n;
+}
+
+static inline char *ikcp_encode_hdr(char *p, IUINT32 conv, IUINT32 cmd,
+    IUINT32 frg, IUINT32 wnd, IUINT32 ts, IUINT32 sn, IUINT32 una,
+    IUINT32 len)
+{
+#if IKCP_SSE2
+    IUINT32 word = (cmd & 0xff) | ((frg & 0xff) << 8) | (wnd << 16);
+    _mm_storeu_si128((__m128i*)p, _mm_set_epi32((int)sn, (int)ts,
+        (int)word, (int)conv));
+    _mm_storel_epi64((__m128i*)(p + 16), _mm_set_epi32(0, 0,
+        (int)len, (int)una));
+    return p + IKCP_OVERHEAD;
+#else
+    p = ikcp_encode32u(p, conv);
+    p = ikcp_encode8u(p, (IUINT8)cmd);
+    p = ikcp_encode8u(p, (IUINT8)frg);
+    p = ikcp_encode16u(p, (IUINT16)wnd);
+    p = ikcp_encode32u(p, ts);
+    p = ikcp_encode32u(p, sn);
+    p = ikcp_encode32u(p, una);
+    p = ikcp_encode32u(p, len);
+    return p;
+#endif
+}
+
 static inline IUINT32 _imin_(IUINT32 a, IUINT32 b) {
     return a <= b ? a : b;
 }
@@ -168,16 +279,307 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
     ikcp_free_hook = new_free;
 }
 
+//---------------------------------------------------------------------
+// segment pool
+//---------------------------------------------------------------------
+#if defined(__GNUC__)
+#define IKCP_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define IKCP_THREAD_LOCAL __declspec(thread)
+#else
+#define IKCP_THREAD_LOCAL
+#endif
+
+#define IKCP_POOL_HEAP 0xffffffff
+#define IKCP_POOL_SLAB 64
+
+// every segment is preceded by a block header telling where it goes back
+typedef struct IKCPBLOCK {
+    struct IKCPBLOCK *next;
+    ikcppool *pool;
+    IUINT32 cls;
+    IUINT32 charge;     // bytes counted in kcp->mem_used
+} IKCPBLOCK;
+
+typedef struct IKCPSLAB {
+    struct IKCPSLAB *next;
+    void *reserved;
+} IKCPSLAB;
+
+static IKCP_THREAD_LOCAL ikcppool *ikcp_pool_local = NULL;
+
+ikcppool* ikcp_pool_create(int mtu, int slab_count)
+{
+    ikcppool *pool;
+    IUINT32 size;
+    int mss = mtu - (int)IKCP_OVERHEAD;
+
+    if (mss <= 0) return NULL;
+
+    pool = (ikcppool*)ikcp_malloc(sizeof(ikcppool));
+    if (pool == NULL) return NULL;
+
+    pool->nclass = 0;
+    pool->mss = (IUINT32)mss;
+    pool->slab_count = (slab_count > 0)? (IUINT32)slab_count : IKCP_POOL_SLAB;
+    pool->nheap = 0;
+    pool->heap_peak = 0;
+    pool->slabs = NULL;
+
+    for (size = 64; pool->nclass < IKCP_POOL_CLASSES; size <<= 2) {
+        struct IKCPPOOLCLASS *c = &pool->classes[pool->nclass++];
+        if (size > pool->mss || pool->nclass == IKCP_POOL_CLASSES)
+            size = pool->mss;
+        c->size = size;
+        c->block = (IUINT32)(sizeof(IKCPBLOCK) + sizeof(IKCPSEG) + size + 7) & ~7u;
+        c->freelist = NULL;
+        c->nfree = 0;
+        c->nused = 0;
+        c->peak = 0;
+        c->nslab = 0;
+        if (size == pool->mss) break;
+    }
+
+    return pool;
+}
+
+void ikcp_pool_release(ikcppool *pool)
+{
+    IKCPSLAB *slab, *next;
+    int i;
+    if (pool == NULL) return;
+    for (i = 0; i < pool->nclass; i++) {
+        assert(pool->classes[i].nused == 0);
+    }
+    assert(pool->nheap == 0);
+    for (slab = (IKCPSLAB*)pool->slabs; slab; slab = next) {
+        next = slab->next;
+        ikcp_free(slab);
+    }
+    if (ikcp_pool_local == pool) {
+        ikcp_pool_local = NULL;
+    }
+    ikcp_free(pool);
+}
+
+void ikcp_setpool(ikcpcb *kcp, ikcppool *pool)
+{
+    kcp->pool = pool;
+}
+
+void ikcp_setpool_thread(ikcppool *pool)
+{
+    ikcp_pool_local = pool;
+}
+
+
+//---------------------------------------------------------------------
+// datagram batch
+//---------------------------------------------------------------------
+static void ikcp_batch_layout(ikcpbatch *batch)
+{
+    size_t stride = (size_t)batch->headroom + batch->mtu + batch->tailroom;
+    int i;
+    for (i = 0; i < batch->capacity; i++) {
+        batch->dgrams[i].data = batch->storage + (size_t)i * stride +
+            batch->headroom;
+    }
+}
+
+ikcpbatch* ikcp_batch_create(int capacity, int mtu,
+    int (*output)(ikcpbatch *batch, void *user), void *user)
+{
+    ikcpbatch *batch;
+    int i;
+
+    if (capacity <= 0 || mtu < (int)IKCP_OVERHEAD || output == NULL)
+        return NULL;
+
+    batch = (ikcpbatch*)ikcp_malloc(sizeof(ikcpbatch));
+    if (batch == NULL) return NULL;
+
+    batch->dgrams = (struct IKCPDGRAM*)
+        ikcp_malloc(sizeof(struct IKCPDGRAM) * capacity);
+    batch->storage = (char*)ikcp_malloc((size_t)capacity * mtu);
+
+    if (batch->dgrams == NULL || batch->storage == NULL) {
+        if (batch->dgrams) ikcp_free(batch->dgrams);
+        if (batch->storage) ikcp_free(batch->storage);
+        ikcp_free(batch);
+        return NULL;
+    }
+
+    batch->count = 0;
+    batch->capacity = capacity;
+    batch->mtu = mtu;
+    batch->headroom = 0;
+    batch->tailroom = 0;
+    ikcp_batch_layout(batch);
+
+    for (i = 0; i < capacity; i++) {
+        batch->dgrams[i].len = 0;
+        batch->dgrams[i].kcp = NULL;
+        batch->dgrams[i].user = NULL;
+    }
+
+    batch->user = user;
+    batch->output = output;
+    return batch;
+}
+
+void ikcp_batch_release(ikcpbatch *batch)
+{
+    if (batch == NULL) return;
+    ikcp_free(batch->dgrams);
+    ikcp_free(batch->storage);
+    ikcp_free(batch);
+}
+
+int ikcp_batch_reserve(ikcpbatch *batch, int head, int tail)
+{
+    char *storage;
+    if (head < 0 || tail < 0 || batch->count > 0)
+        return -1;
+    storage = (char*)ikcp_malloc((size_t)batch->capacity *
+        ((size_t)head + batch->mtu + tail));
+    if (storage == NULL)
+        return -2;
+    ikcp_free(batch->storage);
+    batch->storage = storage;
+    batch->headroom = head;
+    batch->tailroom = tail;
+    ikcp_batch_layout(batch);
+    return 0;
+}
+
+int ikcp_batch_flush(ikcpbatch *batch)
+{
+    int hr = 0;
+    if (batch->count > 0) {
+        hr = batch->output(batch, batch->user);
+        batch->count = 0;
+    }
+    return hr;
+}
+
+int ikcp_setbatch(ikcpcb *kcp, ikcpbatch *batch)
+{
+    if (batch != NULL && (int)kcp->mtu > batch->mtu)
+        return -1;
+    kcp->batch = batch;
+    return 0;
+}
+
+static int ikcp_pool_grow(ikcppool *pool, int cls)
+{
+    struct IKCPPOOLCLASS *c = &pool->classes[cls];
+    IKCPSLAB *slab;
+    char *ptr;
+    IUINT32 i;
+
+    slab = (IKCPSLAB*)ikcp_malloc(sizeof(IKCPSLAB) + c->block * pool->slab_count);
+    if (slab == NULL) return -1;
+
+    slab->next = (IKCPSLAB*)pool->slabs;
+    pool->slabs = slab;
+    c->nslab++;
+
+    ptr = (char*)(slab + 1);
+    for (i = 0; i < pool->slab_count; i++, ptr += c->block) {
+        IKCPBLOCK *block = (IKCPBLOCK*)ptr;
+        block->next = c->freelist;
+        c->freelist = block;
+    }
+    c->nfree += pool->slab_count;
+    return 0;
+}
+
+static IKCPBLOCK* ikcp_pool_alloc(ikcppool *pool, int size)
+{
+    struct IKCPPOOLCLASS *c;
+    IKCPBLOCK *block;
+    int cls;
+
+    for (cls = 0; cls < pool->nclass; cls++) {
+        if ((IUINT32)size <= pool->classes[cls].size) break;
+    }
+    if (cls >= pool->nclass) return NULL;
+
+    c = &pool->classes[cls];
+    if (c->freelist == NULL && ikcp_pool_grow(pool, cls) != 0)
+        return NULL;
+
+    block = c->freelist;
+    c->freelist = block->next;
+    c->nfree--;
+    if (++c->nused > c->peak) c->peak = c->nused;
+
+    block->pool = pool;
+    block->cls = (IUINT32)cls;
+    return block;
+}
+
+// shared owner of user memory referenced by ikcp_sendv fragments
+struct IKCPREF
+{
+    IUINT32 refcnt;
+    void (*release)(void *user);
+    void *user;
+};
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
-    return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+    ikcppool *pool = (kcp->pool != NULL)? kcp->pool : ikcp_pool_local;
+    IKCPBLOCK *block = NULL;
+    IKCPSEG *seg;
+
+    if (pool != NULL) {
+        block = ikcp_pool_alloc(pool, size);
+    }
+
+    if (block == NULL) {
+        block = (IKCPBLOCK*)ikcp_malloc(sizeof(IKCPBLOCK) + sizeof(IKCPSEG) + size);
+        if (block == NULL) return NULL;
+        block->pool = pool;
+        block->cls = IKCP_POOL_HEAP;
+        if (pool != NULL && ++pool->nheap > pool->heap_peak) {
+            pool->heap_peak = pool->nheap;
+        }
+    }
+
+    block->charge = (IUINT32)(sizeof(IKCPSEG) + size);
+    kcp->mem_used += block->charge;
+
+    seg = (IKCPSEG*)(block + 1);
+    seg->ref = NULL;
+    seg->data = seg->buf;
+    return seg;
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-    ikcp_free(seg);
+    IKCPBLOCK *block = ((IKCPBLOCK*)seg) - 1;
+    ikcppool *pool = block->pool;
+
+    if (kcp != NULL) kcp->mem_used -= block->charge;
+
+    if (seg->ref != NULL && --seg->ref->refcnt == 0) {
+        if (seg->ref->release) seg->ref->release(seg->ref->user);
+        ikcp_free(seg->ref);
+    }
+
+    if (block->cls == IKCP_POOL_HEAP) {
+        if (pool != NULL) pool->nheap--;
+        ikcp_free(block);
+    }	else {
+        struct IKCPPOOLCLASS *c = &pool->classes[block->cls];
+        block->next = c->freelist;
+        c->freelist = block;
+        c->nfree++;
+        c->nused--;
+    }
 }
 
 
@@ -199,11 +601,29 @@ static int ikcp_canlog(const ikcpcb *kcp, int mask)
     return 1;
 }
 
+// output scatter/gather list
+static int ikcp_outputv(ikcpcb *kcp, const struct IKCPIOV *iov, int count,
+    int size)
+{
+    assert(kcp);
+    assert(kcp->outputv);
+    if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+        ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
+    }
+    if (size == 0) return 0;
+    return kcp->outputv(iov, count, kcp, kcp->user);
+}
+
 // output segment
 static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 {
     assert(kcp);
-    assert(kcp->output);
+    if (kcp->output == NULL) {
+        struct IKCPIOV iov;
+        iov.base = (const char*)data;
+        iov.len = size;
+        return ikcp_outputv(kcp, &iov, 1, size);
+    }
     if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
         ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
     }
@@ -228,147 +648,647 @@ void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 
 
 //---------------------------------------------------------------------
-// create a new kcpcb
+// memory accounting: segments are charged to kcp->mem_used by
+// ikcp_segment_new, the rings when they are resized
 //---------------------------------------------------------------------
-ikcpcb* ikcp_create(IUINT32 conv, void *user)
+static inline int ikcp_mem_over(const ikcpcb *kcp, IINT64 need)
 {
-    ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
-    if (kcp == NULL) return NULL;
-    kcp->conv = conv;
-    kcp->user = user;
-    kcp->snd_una = 0;
-    kcp->snd_nxt = 0;
-    kcp->rcv_nxt = 0;
-    kcp->ts_recent = 0;
-    kcp->ts_lastack = 0;
-    kcp->ts_probe = 0;
-    kcp->probe_wait = 0;
-    kcp->snd_wnd = IKCP_WND_SND;
-    kcp->rcv_wnd = IKCP_WND_RCV;
-    kcp->rmt_wnd = IKCP_WND_RCV;
-    kcp->cwnd = 0;
-    kcp->incr = 0;
-    kcp->probe = 0;
-    kcp->mtu = IKCP_MTU_DEF;
-    kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-
-    kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
-    if (kcp->buffer == NULL) {
-        ikcp_free(kcp);
-        return NULL;
-    }
+    return kcp->mem_limit > 0 &&
+        (IINT64)(kcp->mem_used + need) > (IINT64)kcp->mem_limit;
+}
 
-    iqueue_init(&kcp->snd_queue);
-    iqueue_init(&kcp->rcv_queue);
-    iqueue_init(&kcp->snd_buf);
-    iqueue_init(&kcp->rcv_buf);
-    kcp->nrcv_buf = 0;
-    kcp->nsnd_buf = 0;
-    kcp->nrcv_que = 0;
-    kcp->nsnd_que = 0;
-    kcp->state = 0;
-    kcp->acklist = NULL;
-    kcp->ackblock = 0;
-    kcp->ackcount = 0;
-    kcp->rx_srtt = 0;
-    kcp->rx_rttval = 0;
-    kcp->rx_rto = IKCP_RTO_DEF;
-    kcp->rx_minrto = IKCP_RTO_MIN;
-    kcp->current = 0;
-    kcp->interval = IKCP_INTERVAL;
-    kcp->ts_flush = IKCP_INTERVAL;
-    kcp->nodelay = 0;
-    kcp->updated = 0;
-    kcp->logmask = 0;
-    kcp->ssthresh = IKCP_THRESH_INIT;
-    kcp->fastresend = 0;
-    kcp->nocwnd = 0;
-    kcp->xmit = 0;
-    kcp->dead_link = IKCP_DEADLINK;
-    kcp->output = NULL;
-    kcp->writelog = NULL;
+// snd_ring, rto_heap and rto_fast
+static inline IINT64 ikcp_ring_bytes(IUINT32 size)
+{
+    return (IINT64)(3 * size + 2) * sizeof(IKCPSEG*);
+}
 
-    return kcp;
+// rcv_slots and rcv_bitmap
+static inline IINT64 ikcp_slot_bytes(IUINT32 size)
+{
+    return (IINT64)size * sizeof(IKCPSEG*) + (size >> 5) * sizeof(IUINT32);
 }
 
 
 //---------------------------------------------------------------------
-// release a new kcpcb
+// send ring: snd_buf segments indexed by (sn & snd_ring_mask)
 //---------------------------------------------------------------------
-void ikcp_release(ikcpcb *kcp)
+static void ikcp_ring_free(ikcpcb *kcp)
 {
-    assert(kcp);
-    if (kcp) {
-        IKCPSEG *seg;
-        while (!iqueue_is_empty(&kcp->snd_buf)) {
-            seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
-        }
-        while (!iqueue_is_empty(&kcp->rcv_buf)) {
-            seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
-        }
-        while (!iqueue_is_empty(&kcp->snd_queue)) {
-            seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
-        }
-        while (!iqueue_is_empty(&kcp->rcv_queue)) {
-            seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
-        }
-        if (kcp->buffer) {
-            ikcp_free(kcp->buffer);
-        }
-        if (kcp->acklist) {
-            ikcp_free(kcp->acklist);
-        }
-
-        kcp->nrcv_buf = 0;
-        kcp->nsnd_buf = 0;
-        kcp->nrcv_que = 0;
-        kcp->nsnd_que = 0;
-        kcp->ackcount = 0;
-        kcp->buffer = NULL;
-        kcp->acklist = NULL;
-        ikcp_free(kcp);
+    if (kcp->snd_ring) {
+        ikcp_free(kcp->snd_ring);
+        ikcp_free(kcp->rto_heap);
+        ikcp_free(kcp->rto_fast);
     }
 }
 
-
-
-//---------------------------------------------------------------------
-// user/upper level recv: returns size, returns below zero for EAGAIN
-//---------------------------------------------------------------------
-int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
+static int ikcp_ring_resize(ikcpcb *kcp, IUINT32 wnd)
 {
+    IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+    IUINT32 size, i;
+    IINT64 old;
+    IKCPSEG **ring, **heap, **fast;
     struct IQUEUEHEAD *p;
-    int ispeek = (len < 0)? 1 : 0;
-    int peeksize;
-    int recover = 0;
-    IKCPSEG *seg;
-    assert(kcp);
 
-    if (iqueue_is_empty(&kcp->rcv_queue))
-        return -1;
+    if (wnd < inflight) wnd = inflight;
+    for (size = 8; size < wnd; size <<= 1);
 
-    if (len < 0) len = -len;
+    if (kcp->snd_ring != NULL && size == kcp->snd_ring_mask + 1)
+        return 0;
 
-    peeksize = ikcp_peeksize(kcp);
+    old = (kcp->snd_ring != NULL)? ikcp_ring_bytes(kcp->snd_ring_mask + 1) : 0;
+    if (ikcp_mem_over(kcp, ikcp_ring_bytes(size) - old)) return -1;
 
-    if (peeksize < 0)
-        return -2;
+    // the retransmit queues hold at most every segment of the ring
+    ring = (IKCPSEG**)ikcp_malloc(size * sizeof(IKCPSEG*));
+    heap = (IKCPSEG**)ikcp_malloc((size + 1) * sizeof(IKCPSEG*));
+    fast = (IKCPSEG**)ikcp_malloc((size + 1) * sizeof(IKCPSEG*));
+    if (ring == NULL || heap == NULL || fast == NULL) {
+        if (ring) ikcp_free(ring);
+        if (heap) ikcp_free(heap);
+        if (fast) ikcp_free(fast);
+        return -1;
+    }
 
-    if (peeksize > len)
-        return -3;
+    for (i = 0; i < size; i++) ring[i] = NULL;
+    for (i = 1; i <= kcp->rto_count; i++) heap[i] = kcp->rto_heap[i];
+    for (i = 1; i <= kcp->rto_nfast; i++) fast[i] = kcp->rto_fast[i];
 
-    if (kcp->nrcv_que >= kcp->rcv_wnd)
-        recover = 1;
+    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+        ring[seg->sn & (size - 1)] = seg;
+    }
 
-    // merge fragment
+    ikcp_ring_free(kcp);
+
+    kcp->mem_used += ikcp_ring_bytes(size) - old;
+    kcp->snd_ring = ring;
+    kcp->snd_ring_mask = size - 1;
+    kcp->rto_heap = heap;
+    kcp->rto_fast = fast;
+    return 0;
+}
+
+static inline IKCPSEG *ikcp_ring_get(const ikcpcb *kcp, IUINT32 sn)
+{
+    IKCPSEG *seg = kcp->snd_ring[sn & kcp->snd_ring_mask];
+    return (seg != NULL && seg->sn == sn)? seg : NULL;
+}
+
+
+//---------------------------------------------------------------------
+// retransmit queues: every sent segment of snd_buf is in rto_heap, the
+// earliest resendts at rto_heap[1], and in rto_fast as well once its
+// fast acks reach fastresend. both count from index 1.
+//---------------------------------------------------------------------
+static inline void ikcp_heap_set(ikcpcb *kcp, IUINT32 i, IKCPSEG *seg)
+{
+    kcp->rto_heap[i] = seg;
+    seg->heap = i;
+}
+
+static void ikcp_heap_up(ikcpcb *kcp, IUINT32 i)
+{
+    IKCPSEG *seg = kcp->rto_heap[i];
+    while (i > 1) {
+        IKCPSEG *parent = kcp->rto_heap[i >> 1];
+        if (_itimediff(seg->resendts, parent->resendts) >= 0) break;
+        ikcp_heap_set(kcp, i, parent);
+        i >>= 1;
+    }
+    ikcp_heap_set(kcp, i, seg);
+}
+
+static void ikcp_heap_down(ikcpcb *kcp, IUINT32 i)
+{
+    IKCPSEG *seg = kcp->rto_heap[i];
+    for (;;) {
+        IUINT32 child = i << 1;
+        if (child > kcp->rto_count) break;
+        if (child < kcp->rto_count &&
+            _itimediff(kcp->rto_heap[child + 1]->resendts,
+            kcp->rto_heap[child]->resendts) < 0) {
+            child++;
+        }
+        if (_itimediff(kcp->rto_heap[child]->resendts, seg->resendts) >= 0)
+            break;
+        ikcp_heap_set(kcp, i, kcp->rto_heap[child]);
+        i = child;
+    }
+    ikcp_heap_set(kcp, i, seg);
+}
+
+// insert 'seg', or reorder it after its resendts changed
+static void ikcp_heap_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+    IUINT32 i = seg->heap;
+    if (i == 0) {
+        i = ++kcp->rto_count;
+        ikcp_heap_set(kcp, i, seg);
+    }
+    ikcp_heap_up(kcp, i);
+    ikcp_heap_down(kcp, seg->heap);
+}
+
+static void ikcp_heap_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+    IUINT32 i = seg->heap;
+    IKCPSEG *last;
+    if (i == 0) return;
+    seg->heap = 0;
+    last = kcp->rto_heap[kcp->rto_count--];
+    if (last == seg) return;
+    ikcp_heap_set(kcp, i, last);
+    ikcp_heap_up(kcp, i);
+    ikcp_heap_down(kcp, last->heap);
+}
+
+static inline void ikcp_fast_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+    if (seg->fast == 0) {
+        seg->fast = ++kcp->rto_nfast;
+        kcp->rto_fast[seg->fast] = seg;
+    }
+}
+
+static inline void ikcp_fast_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+    if (seg->fast != 0) {
+        IKCPSEG *last = kcp->rto_fast[kcp->rto_nfast--];
+        kcp->rto_fast[seg->fast] = last;
+        last->fast = seg->fast;
+        seg->fast = 0;
+    }
+}
+
+// a segment leaving snd_buf
+static inline void ikcp_rto_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+    ikcp_heap_remove(kcp, seg);
+    ikcp_fast_remove(kcp, seg);
+}
+
+// fast acks for a sent segment, queued once they reach fastresend
+static inline void ikcp_rto_fastack(ikcpcb *kcp, IKCPSEG *seg, IUINT32 count)
+{
+    seg->fastack += count;
+    if (kcp->fastresend > 0 && seg->heap != 0 &&
+        seg->fastack >= (IUINT32)kcp->fastresend) {
+        ikcp_fast_push(kcp, seg);
+    }
+}
+
+
+//---------------------------------------------------------------------
+// receive slots: out of order segments at rcv_slots[sn & rcv_slot_mask],
+// rcv_bitmap marks the occupied slots
+//---------------------------------------------------------------------
+static inline int ikcp_ctz(IUINT32 x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) { x >>= 1; n++; }
+    return n;
+#endif
+}
+
+static inline int ikcp_slot_test(const ikcpcb *kcp, IUINT32 idx)
+{
+    return (kcp->rcv_bitmap[idx >> 5] >> (idx & 31)) & 1;
+}
+
+static inline void ikcp_slot_set(ikcpcb *kcp, IUINT32 idx, IKCPSEG *seg)
+{
+    kcp->rcv_slots[idx] = seg;
+    kcp->rcv_bitmap[idx >> 5] |= (IUINT32)1 << (idx & 31);
+}
+
+static inline IKCPSEG *ikcp_slot_take(ikcpcb *kcp, IUINT32 idx)
+{
+    IKCPSEG *seg = kcp->rcv_slots[idx];
+    kcp->rcv_slots[idx] = NULL;
+    kcp->rcv_bitmap[idx >> 5] &= ~((IUINT32)1 << (idx & 31));
+    return seg;
+}
+
+// number of occupied slots in a row starting at sn, at most limit
+static IUINT32 ikcp_slot_run(const ikcpcb *kcp, IUINT32 sn, IUINT32 limit)
+{
+    IUINT32 count = 0;
+    while (count < limit) {
+        IUINT32 idx = (sn + count) & kcp->rcv_slot_mask;
+        IUINT32 off = idx & 31;
+        IUINT32 bits = ~(kcp->rcv_bitmap[idx >> 5] >> off);
+        IUINT32 run = (bits == 0)? 32 : (IUINT32)ikcp_ctz(bits);
+        count += run;
+        if (run < 32 - off) break;
+    }
+    return _imin_(count, limit);
+}
+
+// the 32 slot bits starting at sn, bit i for sn + i
+static IUINT32 ikcp_slot_word(const ikcpcb *kcp, IUINT32 sn)
+{
+    IUINT32 idx = sn & kcp->rcv_slot_mask;
+    IUINT32 nword = (kcp->rcv_slot_mask >> 5) + 1;
+    IUINT32 off = idx & 31;
+    IUINT32 bits = kcp->rcv_bitmap[idx >> 5] >> off;
+    if (off != 0) {
+        bits |= kcp->rcv_bitmap[((idx >> 5) + 1) & (nword - 1)] << (32 - off);
+    }
+    return bits;
+}
+
+static int ikcp_slot_resize(ikcpcb *kcp, IUINT32 wnd)
+{
+    IUINT32 size, i, nword;
+    IINT64 old;
+    IKCPSEG **slots;
+    IUINT32 *bitmap;
+
+    for (size = 32; size < wnd; size <<= 1);
+
+    if (kcp->rcv_slots != NULL && size == kcp->rcv_slot_mask + 1) {
+        // same slots, but a shrunk window still drops what lies past it
+        for (i = 0; i <= kcp->rcv_slot_mask; i++) {
+            IKCPSEG *seg;
+            if (ikcp_slot_test(kcp, i) == 0) continue;
+            seg = kcp->rcv_slots[i];
+            if (_itimediff(seg->sn, kcp->rcv_nxt + wnd) >= 0) {
+                ikcp_segment_delete(kcp, ikcp_slot_take(kcp, i));
+                kcp->nrcv_buf--;
+            }
+        }
+        return 0;
+    }
+
+    old = (kcp->rcv_slots != NULL)? ikcp_slot_bytes(kcp->rcv_slot_mask + 1) : 0;
+    if (ikcp_mem_over(kcp, ikcp_slot_bytes(size) - old)) return -1;
+
+    nword = size >> 5;
+    slots = (IKCPSEG**)ikcp_malloc(size * sizeof(IKCPSEG*));
+    bitmap = (IUINT32*)ikcp_malloc(nword * sizeof(IUINT32));
+
+    if (slots == NULL || bitmap == NULL) {
+        if (slots) ikcp_free(slots);
+        if (bitmap) ikcp_free(bitmap);
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) slots[i] = NULL;
+    for (i = 0; i < nword; i++) bitmap[i] = 0;
+
+    if (kcp->rcv_slots != NULL) {
+        for (i = 0; i <= kcp->rcv_slot_mask; i++) {
+            IKCPSEG *seg;
+            IUINT32 idx;
+            if (ikcp_slot_test(kcp, i) == 0) continue;
+            seg = kcp->rcv_slots[i];
+            if (_itimediff(seg->sn, kcp->rcv_nxt + wnd) >= 0) {
+                ikcp_segment_delete(kcp, seg);
+                kcp->nrcv_buf--;
+                continue;
+            }
+            idx = seg->sn & (size - 1);
+            slots[idx] = seg;
+            bitmap[idx >> 5] |= (IUINT32)1 << (idx & 31);
+        }
+        ikcp_free(kcp->rcv_slots);
+        ikcp_free(kcp->rcv_bitmap);
+    }
+
+    kcp->mem_used += ikcp_slot_bytes(size) - old;
+    kcp->rcv_slots = slots;
+    kcp->rcv_bitmap = bitmap;
+    kcp->rcv_slot_mask = size - 1;
+    return 0;
+}
+
+// move available data from rcv_slots -> rcv_queue
+static void ikcp_slot_drain(ikcpcb *kcp)
+{
+    IUINT32 count;
+
+    if (kcp->nrcv_buf == 0 || kcp->nrcv_que >= kcp->rcv_wnd)
+        return;
+
+    count = ikcp_slot_run(kcp, kcp->rcv_nxt, kcp->rcv_wnd - kcp->nrcv_que);
+
+    for (; count > 0; count--) {
+        IKCPSEG *seg = ikcp_slot_take(kcp, kcp->rcv_nxt & kcp->rcv_slot_mask);
+        kcp->nrcv_buf--;
+        iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+        kcp->nrcv_que++;
+        kcp->rcv_nxt++;
+    }
+}
+
+// kcp->buffer points 'headroom' bytes into its allocation
+static char *ikcp_buffer_alloc(IUINT32 mtu, int headroom, int tailroom)
+{
+    char *ptr = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3 +
+        headroom + tailroom);
+    return (ptr == NULL)? NULL : ptr + headroom;
+}
+
+static void ikcp_buffer_free(ikcpcb *kcp)
+{
+    ikcp_free(kcp->buffer - kcp->headroom);
+}
+
+// slices of one datagram for outputv, a header and a payload for each
+// segment it can hold. allocated with the buffer, whether outputv is set
+// or not, so a failure is reported where the mtu is set
+static struct IKCPIOV *ikcp_iov_alloc(IUINT32 mtu)
+{
+    int count = 2 * (int)(mtu / IKCP_OVERHEAD) + 2;
+    return (struct IKCPIOV*)ikcp_malloc(sizeof(struct IKCPIOV) * count);
+}
+
+
+//---------------------------------------------------------------------
+// create a new kcpcb
+//---------------------------------------------------------------------
+ikcpcb* ikcp_create(IUINT32 conv, void *user)
+{
+    ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
+    if (kcp == NULL) return NULL;
+    kcp->conv = conv;
+    kcp->user = user;
+    kcp->snd_una = 0;
+    kcp->snd_nxt = 0;
+    kcp->rcv_nxt = 0;
+    kcp->ts_recent = 0;
+    kcp->ts_lastack = 0;
+    kcp->ts_probe = 0;
+    kcp->probe_wait = 0;
+    kcp->snd_wnd = IKCP_WND_SND;
+    kcp->rcv_wnd = IKCP_WND_RCV;
+    kcp->rmt_wnd = IKCP_WND_RCV;
+    kcp->cwnd = 0;
+    kcp->incr = 0;
+    kcp->probe = 0;
+    kcp->mtu = IKCP_MTU_DEF;
+    kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+
+    kcp->headroom = 0;
+    kcp->tailroom = 0;
+    kcp->buffer = ikcp_buffer_alloc(kcp->mtu, 0, 0);
+    if (kcp->buffer == NULL) {
+        ikcp_free(kcp);
+        return NULL;
+    }
+
+    iqueue_init(&kcp->snd_queue);
+    iqueue_init(&kcp->rcv_queue);
+    iqueue_init(&kcp->snd_buf);
+    kcp->nrcv_buf = 0;
+    kcp->nsnd_buf = 0;
+    kcp->nrcv_que = 0;
+    kcp->nsnd_que = 0;
+    kcp->state = 0;
+    kcp->acklist = NULL;
+    kcp->ackblock = 0;
+    kcp->ackcount = 0;
+    kcp->rx_srtt = 0;
+    kcp->rx_rttval = 0;
+    kcp->rx_rto = IKCP_RTO_DEF;
+    kcp->rx_minrto = IKCP_RTO_MIN;
+    kcp->current = 0;
+    kcp->interval = IKCP_INTERVAL;
+    kcp->ts_flush = IKCP_INTERVAL;
+    kcp->clock = IKCP_CLOCK_MS;
+    kcp->nodelay = 0;
+    kcp->updated = 0;
+    kcp->logmask = 0;
+    kcp->ssthresh = IKCP_THRESH_INIT;
+    kcp->fastresend = 0;
+    kcp->nocwnd = 0;
+    kcp->sack = 0;
+    kcp->rmt_sack = 0;
+    kcp->wscale = 0;
+    kcp->rmt_wscale = 0;
+    kcp->stream = 0;
+    kcp->large = 0;
+    kcp->immediate = 0;
+    kcp->mem_used = 0;
+    kcp->mem_limit = 0;
+    memset(&kcp->stats, 0, sizeof(kcp->stats));
+    kcp->stats_seq = 0;
+    kcp->stream_tail = NULL;
+    kcp->xmit = 0;
+    kcp->dead_link = IKCP_DEADLINK;
+    kcp->output = NULL;
+    kcp->writelog = NULL;
+    kcp->now = NULL;
+    kcp->snd_ring = NULL;
+    kcp->snd_ring_mask = 0;
+    kcp->rto_heap = NULL;
+    kcp->rto_fast = NULL;
+    kcp->rto_count = 0;
+    kcp->rto_nfast = 0;
+    kcp->rcv_slots = NULL;
+    kcp->rcv_bitmap = NULL;
+    kcp->rcv_slot_mask = 0;
+    kcp->pool = NULL;
+    kcp->batch = NULL;
+    kcp->dgram = NULL;
+    kcp->iov = NULL;
+    kcp->niov = 0;
+    kcp->iovlen = 0;
+    kcp->iovhead = NULL;
+    kcp->outputv = NULL;
+    kcp->delivered = 0;
+    kcp->delivered_ts = 0;
+    kcp->cc = &ikcp_cc_reno;
+    kcp->cc_state = NULL;
+    kcp->pacing = 0;
+    kcp->pace_held = 0;
+    kcp->pace_conf = 0;
+    kcp->pace_rate = 0;
+    kcp->pace_last = 0;
+    kcp->pace_next = 0;
+    kcp->pace_tokens = 0;
+
+    kcp->iov = ikcp_iov_alloc(kcp->mtu);
+    if (kcp->iov == NULL ||
+        ikcp_ring_resize(kcp, kcp->snd_wnd) != 0 ||
+        ikcp_slot_resize(kcp, kcp->rcv_wnd) != 0) {
+        ikcp_ring_free(kcp);
+        if (kcp->iov) ikcp_free(kcp->iov);
+        ikcp_buffer_free(kcp);
+        ikcp_free(kcp);
+        return NULL;
+    }
+
+    return kcp;
+}
+
+
+//---------------------------------------------------------------------
+// release a new kcpcb
+//---------------------------------------------------------------------
+void ikcp_release(ikcpcb *kcp)
+{
+    assert(kcp);
+    if (kcp) {
+        IKCPSEG *seg;
+        while (!iqueue_is_empty(&kcp->snd_buf)) {
+            seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
+            iqueue_del(&seg->node);
+            ikcp_segment_delete(kcp, seg);
+        }
+        if (kcp->rcv_slots) {
+            IUINT32 i;
+            for (i = 0; i <= kcp->rcv_slot_mask; i++) {
+                if (ikcp_slot_test(kcp, i)) {
+                    ikcp_segment_delete(kcp, ikcp_slot_take(kcp, i));
+                }
+            }
+            ikcp_free(kcp->rcv_slots);
+            ikcp_free(kcp->rcv_bitmap);
+        }
+        while (!iqueue_is_empty(&kcp->snd_queue)) {
+            seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+            iqueue_del(&seg->node);
+            ikcp_segment_delete(kcp, seg);
+        }
+        while (!iqueue_is_empty(&kcp->rcv_queue)) {
+            seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+            iqueue_del(&seg->node);
+            ikcp_segment_delete(kcp, seg);
+        }
+        if (kcp->buffer) {
+            ikcp_buffer_free(kcp);
+        }
+        if (kcp->acklist) {
+            ikcp_free(kcp->acklist);
+        }
+        ikcp_ring_free(kcp);
+        if (kcp->iov) {
+            ikcp_free(kcp->iov);
+        }
+        if (kcp->cc->release) {
+            kcp->cc->release(kcp);
+        }
+
+        kcp->nrcv_buf = 0;
+        kcp->nsnd_buf = 0;
+        kcp->nrcv_que = 0;
+        kcp->nsnd_que = 0;
+        kcp->ackcount = 0;
+        kcp->buffer = NULL;
+        kcp->acklist = NULL;
+        kcp->snd_ring = NULL;
+        kcp->rto_heap = NULL;
+        kcp->rto_fast = NULL;
+        kcp->rto_count = 0;
+        kcp->rto_nfast = 0;
+        kcp->iov = NULL;
+        kcp->rcv_slots = NULL;
+        kcp->rcv_bitmap = NULL;
+        ikcp_free(kcp);
+    }
+}
+
+
+
+//---------------------------------------------------------------------
+// byte level recv: copy up to 'len' bytes, a partly read segment stays
+// at the head of rcv_queue with 'data' moved past the bytes taken.
+// given 'last', stops at the end of the message and tells if reached.
+//---------------------------------------------------------------------
+static int ikcp_recv_bytes(ikcpcb *kcp, char *buffer, int len, int ispeek,
+    int *last)
+{
+    struct IQUEUEHEAD *p;
+    int recover = 0;
+    int total = 0;
+    int fragment;
+
+    if (last) *last = 0;
+
+    if (kcp->nrcv_que >= kcp->rcv_wnd)
+        recover = 1;
+
+    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue && total < len; ) {
+        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+        int size = (int)_imin_(seg->len, (IUINT32)(len - total));
+        p = p->next;
+
+        if (buffer) {
+            memcpy(buffer + total, seg->data, size);
+        }
+        total += size;
+
+        if (ispeek) continue;
+
+        if (size < (int)seg->len) {
+            seg->data += size;
+            seg->len -= size;
+            break;
+        }
+
+        if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+            ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+        }
+
+        fragment = seg->frg;
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(kcp, seg);
+        kcp->nrcv_que--;
+
+        if (last && fragment == 0) {
+            *last = 1;
+            break;
+        }
+    }
+
+    if (ispeek == 0) {
+        ikcp_slot_drain(kcp);
+        if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+            kcp->probe |= IKCP_ASK_TELL;
+        }
+    }
+
+    return total;
+}
+
+
+//---------------------------------------------------------------------
+// user/upper level recv: returns size, returns below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
+{
+    struct IQUEUEHEAD *p;
+    int ispeek = (len < 0)? 1 : 0;
+    int peeksize;
+    int recover = 0;
+    IKCPSEG *seg;
+    assert(kcp);
+
+    if (iqueue_is_empty(&kcp->rcv_queue))
+        return -1;
+
+    if (len < 0) len = -len;
+
+    if (kcp->stream)
+        return ikcp_recv_bytes(kcp, buffer, len, ispeek, NULL);
+
+    peeksize = ikcp_peeksize(kcp);
+
+    if (peeksize < 0)
+        return -2;
+
+    if (peeksize > len)
+        return -3;
+
+    if (kcp->nrcv_que >= kcp->rcv_wnd)
+        recover = 1;
+
+    // merge fragment
     for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue; ) {
         int fragment;
         seg = iqueue_entry(p, IKCPSEG, node);
@@ -398,19 +1318,8 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 
     assert(len == peeksize);
 
-    // move available data from rcv_buf -> rcv_queue
-    while (! iqueue_is_empty(&kcp->rcv_buf)) {
-        IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            kcp->rcv_nxt++;
-        }	else {
-            break;
-        }
-    }
+    // move available data from rcv_slots -> rcv_queue
+    ikcp_slot_drain(kcp);
 
     // fast recover
     if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -423,6 +1332,108 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// user/upper level recv of part of a message, below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recvpart(ikcpcb *kcp, char *buffer, int len, int *last)
+{
+    assert(kcp);
+
+    if (last) *last = 0;
+
+    if (iqueue_is_empty(&kcp->rcv_queue))
+        return -1;
+
+    if (len < 0)
+        return -3;
+
+    return ikcp_recv_bytes(kcp, buffer, len, 0, last);
+}
+
+
+//---------------------------------------------------------------------
+// user/upper level recv without copying, returns below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recvmsg(ikcpcb *kcp, ikcpmsg *msg)
+{
+    int recover = 0;
+    IKCPSEG *seg;
+    assert(kcp && msg);
+
+    iqueue_init(&msg->segs);
+    msg->size = 0;
+    msg->count = 0;
+
+    if (iqueue_is_empty(&kcp->rcv_queue))
+        return -1;
+
+    // rcv_queue is contiguous, the head fragment tells the message length
+    seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+    if (kcp->nrcv_que < seg->frg + 1)
+        return -2;
+
+    // saturated frg only bounds it, look for the last fragment
+    if (seg->frg == 255 && ikcp_peeksize(kcp) < 0)
+        return -2;
+
+    if (kcp->nrcv_que >= kcp->rcv_wnd)
+        recover = 1;
+
+    while (1) {
+        int fragment;
+        seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+        iqueue_del(&seg->node);
+        iqueue_add_tail(&seg->node, &msg->segs);
+        kcp->mem_used -= (((IKCPBLOCK*)seg) - 1)->charge;
+        (((IKCPBLOCK*)seg) - 1)->charge = 0;
+        kcp->nrcv_que--;
+        msg->size += seg->len;
+        msg->count++;
+        fragment = seg->frg;
+
+        if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+            ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+        }
+
+        if (fragment == 0)
+            break;
+    }
+
+    ikcp_slot_drain(kcp);
+
+    if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+        kcp->probe |= IKCP_ASK_TELL;
+    }
+
+    return msg->size;
+}
+
+int ikcp_msg_views(const ikcpmsg *msg, struct IKCPIOV *iov, int count)
+{
+    const struct IQUEUEHEAD *p;
+    int i = 0;
+    for (p = msg->segs.next; p != &msg->segs && i < count; p = p->next) {
+        const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+        iov[i].base = seg->data;
+        iov[i].len = (int)seg->len;
+        i++;
+    }
+    return msg->count;
+}
+
+void ikcp_msg_release(ikcpmsg *msg)
+{
+    IKCPSEG *seg;
+    while (!iqueue_is_empty(&msg->segs)) {
+        seg = iqueue_entry(msg->segs.next, IKCPSEG, node);
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(NULL, seg);
+    }
+    msg->size = 0;
+    msg->count = 0;
+}
+
+
 //---------------------------------------------------------------------
 // peek data size
 //---------------------------------------------------------------------
@@ -436,6 +1447,14 @@ int ikcp_peeksize(const ikcpcb *kcp)
 
     if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
 
+    if (kcp->stream) {
+        for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+            seg = iqueue_entry(p, IKCPSEG, node);
+            length += seg->len;
+        }
+        return length;
+    }
+
     seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
     if (seg->frg == 0) return seg->len;
 
@@ -447,32 +1466,76 @@ int ikcp_peeksize(const ikcpcb *kcp)
         if (seg->frg == 0) break;
     }
 
+    // a large message still missing its tail
+    if (p == &kcp->rcv_queue) return -1;
+
     return length;
 }
 
 
+// immediate mode flush, defined with ikcp_flush
+static void ikcp_flush_fresh(ikcpcb *kcp);
+
+// the clock given to ikcp_setimmediate if any, else the time of the
+// last ikcp_update. never behind kcp->current
+static IUINT32 ikcp_now(ikcpcb *kcp)
+{
+    IUINT32 current;
+    if (kcp->now == NULL) return kcp->current;
+    current = kcp->now(kcp, kcp->user);
+    return (_itimediff(current, kcp->current) > 0)? current : kcp->current;
+}
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 {
-    IKCPSEG *seg;
-    int count, i;
+    IKCPSEG *seg, *tail = NULL;
+    IUINT32 queued = ikcp_now(kcp);
+    int count, i, extend = 0;
 
     assert(kcp->mss > 0);
     if (len < 0) return -1;
 
-    if (len <= (int)kcp->mss) count = 1;
-    else count = (len + kcp->mss - 1) / kcp->mss;
+    // stream mode: top up the segment queued by the previous call, once
+    // the rest is known to fit, so a refused call leaves it untouched
+    if (kcp->stream) {
+        if (!iqueue_is_empty(&kcp->snd_queue)) {
+            seg = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
+            if (seg == kcp->stream_tail && seg->ref == NULL &&
+                seg->len < kcp->mss) {
+                tail = seg;
+                extend = (int)_imin_((IUINT32)len, kcp->mss - seg->len);
+            }
+        }
+        if (len == 0) return 0;
+    }
+
+    if (len - extend <= (int)kcp->mss) count = 1;
+    else count = (len - extend + kcp->mss - 1) / kcp->mss;
 
-    if (count > 255) return -2;
+    if (count > 255 && kcp->stream == 0 && kcp->large == 0) return -2;
 
-    if (count == 0) count = 1;
+    if (len > extend && ikcp_mem_over(kcp, (IINT64)count * sizeof(IKCPSEG) +
+        (kcp->stream? (IINT64)count * kcp->mss : len))) {
+        return -3;
+    }
+
+    if (tail != NULL) {
+        if (buffer) {
+            memcpy(tail->data + tail->len, buffer, extend);
+            buffer += extend;
+        }
+        tail->len += extend;
+        len -= extend;
+        if (len == 0) return 0;
+    }
 
     // fragment
     for (i = 0; i < count; i++) {
         int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-        seg = ikcp_segment_new(kcp, size);
+        seg = ikcp_segment_new(kcp, kcp->stream? (int)kcp->mss : size);
         assert(seg);
         if (seg == NULL) {
             return -2;
@@ -481,7 +1544,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
             memcpy(seg->data, buffer, size);
         }
         seg->len = size;
-        seg->frg = count - i - 1;
+        seg->frg = kcp->stream? 0 : _imin_(count - i - 1, 255);
+        seg->queued = queued;
         iqueue_init(&seg->node);
         iqueue_add_tail(&seg->node, &kcp->snd_queue);
         kcp->nsnd_que++;
@@ -491,10 +1555,145 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
         len -= size;
     }
 
+    if (kcp->stream) kcp->stream_tail = seg;
+
+    if (kcp->immediate) ikcp_flush_fresh(kcp);
+
     return 0;
 }
 
 
+//---------------------------------------------------------------------
+// user/upper level send without copying: returns 1 once segments
+// reference the slices, 0 for an empty message, below zero for error
+//---------------------------------------------------------------------
+static int ikcp_sendv_ref(ikcpcb *kcp, const struct IKCPIOV *iov, int count,
+    void (*release)(void *user), void *user)
+{
+    struct IQUEUEHEAD queue;
+    struct IKCPREF *ref;
+    IKCPSEG *seg;
+    IUINT32 queued;
+    int nfrag = 0, i;
+
+    assert(kcp->mss > 0);
+    if (count < 0 || (count > 0 && iov == NULL)) return -1;
+
+    // fragments never straddle slices, count them up front
+    for (i = 0; i < count; i++) {
+        if (iov[i].len < 0) return -1;
+        nfrag += (iov[i].len + kcp->mss - 1) / kcp->mss;
+    }
+
+    if (nfrag > 255 && kcp->stream == 0 && kcp->large == 0) return -2;
+
+    // the slices are the caller's, only the segments count
+    if (ikcp_mem_over(kcp, (IINT64)nfrag * sizeof(IKCPSEG))) return -3;
+
+    if (nfrag == 0) {
+        // empty message, nothing to reference
+        return ikcp_send(kcp, NULL, 0);
+    }
+
+    ref = (struct IKCPREF*)ikcp_malloc(sizeof(struct IKCPREF));
+    if (ref == NULL) return -2;
+    ref->refcnt = 0;
+    ref->release = release;
+    ref->user = user;
+
+    // build the fragments aside so a failure leaves snd_queue untouched
+    iqueue_init(&queue);
+    queued = ikcp_now(kcp);
+
+    for (i = 0; i < count; i++) {
+        const char *base = iov[i].base;
+        int len = iov[i].len;
+        while (len > 0) {
+            int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+            seg = ikcp_segment_new(kcp, 0);
+            if (seg == NULL) {
+                while (!iqueue_is_empty(&queue)) {
+                    seg = iqueue_entry(queue.next, IKCPSEG, node);
+                    iqueue_del(&seg->node);
+                    seg->ref = NULL;
+                    ikcp_segment_delete(kcp, seg);
+                }
+                ikcp_free(ref);
+                return -2;
+            }
+            seg->data = (char*)base;
+            seg->len = size;
+            seg->frg = kcp->stream? 0 : _imin_(--nfrag, 255);
+            seg->queued = queued;
+            seg->ref = ref;
+            ref->refcnt++;
+            iqueue_add_tail(&seg->node, &queue);
+            base += size;
+            len -= size;
+        }
+    }
+
+    while (!iqueue_is_empty(&queue)) {
+        seg = iqueue_entry(queue.next, IKCPSEG, node);
+        iqueue_del(&seg->node);
+        iqueue_add_tail(&seg->node, &kcp->snd_queue);
+        kcp->nsnd_que++;
+    }
+
+    if (kcp->immediate) ikcp_flush_fresh(kcp);
+
+    return 1;
+}
+
+int ikcp_sendv(ikcpcb *kcp, const struct IKCPIOV *iov, int count,
+    void (*release)(void *user), void *user)
+{
+    int hr = ikcp_sendv_ref(kcp, iov, count, release, user);
+    if (hr > 0) return 0;
+    // no segment references the slices, they are the caller's again
+    if (release) release(user);
+    return hr;
+}
+
+
+//---------------------------------------------------------------------
+// statistics: kcp->stats only changes between ikcp_stats_begin and
+// ikcp_stats_end, which leave kcp->stats_seq odd in between
+//---------------------------------------------------------------------
+static inline void ikcp_stats_begin(ikcpcb *kcp)
+{
+    IKCP_STORE_RELEASE(&kcp->stats_seq, kcp->stats_seq + 1);
+    IKCP_WMB();
+}
+
+static inline void ikcp_stats_end(ikcpcb *kcp)
+{
+    IKCP_STORE_RELEASE(&kcp->stats_seq, kcp->stats_seq + 1);
+}
+
+static inline int ikcp_stats_bucket(IUINT32 x)
+{
+    int i;
+#if defined(__GNUC__)
+    i = (x == 0)? 0 : 32 - __builtin_clz(x);
+#else
+    for (i = 0; x > 0; i++) x >>= 1;
+#endif
+    return (i < IKCP_STATS_BUCKETS)? i : IKCP_STATS_BUCKETS - 1;
+}
+
+void ikcp_stats(const ikcpcb *kcp, ikcpstats *stats)
+{
+    IUINT32 seq;
+    do {
+        while ((seq = kcp->stats_seq) & 1);
+        IKCP_BARRIER();
+        memcpy(stats, (const void*)&kcp->stats, sizeof(ikcpstats));
+        IKCP_BARRIER();
+    } while (seq != kcp->stats_seq);
+}
+
+
 //---------------------------------------------------------------------
 // parse ack
 //---------------------------------------------------------------------
@@ -512,7 +1711,25 @@ static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
         if (kcp->rx_srtt < 1) kcp->rx_srtt = 1;
     }
     rto = kcp->rx_srtt + _imax_(1, 4 * kcp->rx_rttval);
-    kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+    kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX * kcp->clock);
+    kcp->rs.rtt = rtt;
+    kcp->stats.rtt_hist[ikcp_stats_bucket((IUINT32)rtt)]++;
+}
+
+// count an acked segment into kcp->rs, the newest sent one gives the
+// delivery rate sample. a retransmitted segment gives none: its ack may
+// be for any of its sends
+static void ikcp_ack_rate(ikcpcb *kcp, const IKCPSEG *seg, IUINT32 current)
+{
+    kcp->stats.latency_hist[ikcp_stats_bucket(current - seg->queued)]++;
+    kcp->delivered++;
+    kcp->delivered_ts = kcp->current;
+    if (seg->xmit <= 1 && (kcp->rs.interval < 0 ||
+        _itimediff(seg->delivered, kcp->rs.delivered) > 0)) {
+        kcp->rs.delivered = seg->delivered;
+        kcp->rs.interval = _itimediff(kcp->current, seg->delivered_ts);
+    }
+    kcp->rs.acked++;
 }
 
 static void ikcp_shrink_buf(ikcpcb *kcp)
@@ -526,44 +1743,106 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
     }
 }
 
-static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
+// returns 1 if sn was in flight, 2 if it is in the window but already
+// gone from snd_buf, 0 if it is outside the window
+static int ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn, IUINT32 current)
+{
+    IKCPSEG *seg;
+
+    if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+        return 0;
+
+    seg = ikcp_ring_get(kcp, sn);
+    if (seg != NULL) {
+        ikcp_ack_rate(kcp, seg, current);
+        ikcp_rto_remove(kcp, seg);
+        kcp->snd_ring[sn & kcp->snd_ring_mask] = NULL;
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(kcp, seg);
+        kcp->nsnd_buf--;
+        return 1;
+    }
+
+    return 2;
+}
+
+// every segment still in snd_buf gets one fastack per acked sn above it.
+// 'acks' holds the in-flight sns acked by one input batch, unsorted.
+// 'missing' counts acks of sns no longer in snd_buf, each of which
+// bumps every segment, as the list walk of ikcp_parse_ack used to.
+static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 *acks, int count,
+    int missing)
+{
+    struct IQUEUEHEAD *p;
+    int i, j;
+
+    if (count <= 0 && missing <= 0) return;
+
+    for (i = 1; i < count; i++) {
+        IUINT32 sn = acks[i];
+        for (j = i; j > 0 && _itimediff(acks[j - 1], sn) > 0; j--)
+            acks[j] = acks[j - 1];
+        acks[j] = sn;
+    }
+
+    for (p = kcp->snd_buf.next, i = 0; p != &kcp->snd_buf; p = p->next) {
+        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+        if (missing == 0 && _itimediff(seg->sn, acks[count - 1]) >= 0)
+            break;
+        while (i < count && _itimediff(acks[i], seg->sn) <= 0) i++;
+        ikcp_rto_fastack(kcp, seg, count - i + missing);
+    }
+}
+
+static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una, IUINT32 current)
 {
+#if 1
     struct IQUEUEHEAD *p, *next;
-
-    if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
-        return;
-
     for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
         IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
         next = p->next;
-        if (sn == seg->sn) {
+        if (_itimediff(una, seg->sn) > 0) {
+            ikcp_ack_rate(kcp, seg, current);
+            ikcp_rto_remove(kcp, seg);
+            kcp->snd_ring[seg->sn & kcp->snd_ring_mask] = NULL;
             iqueue_del(p);
             ikcp_segment_delete(kcp, seg);
             kcp->nsnd_buf--;
+        }	else {
             break;
         }
-        else {
-            seg->fastack++;
-        }
     }
+#endif
 }
 
-static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
+
+// one pass from the tail of snd_buf: segments whose bit is set in the
+// bitmap (bit i for sn una + i) are acked, every segment left behind gets
+// one fastack per newly acked sn above it, as a run of ACKs would do.
+static void ikcp_parse_sack(ikcpcb *kcp, IUINT32 una, const char *bitmap,
+    IUINT32 len, IUINT32 current)
 {
-#if 1
-    struct IQUEUEHEAD *p, *next;
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+    struct IQUEUEHEAD *p, *prev;
+    IUINT32 bits = len * 8;
+    IUINT32 acked = 0;
+
+    for (p = kcp->snd_buf.prev; p != &kcp->snd_buf; p = prev) {
         IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-        next = p->next;
-        if (_itimediff(una, seg->sn) > 0) {
+        IUINT32 off = seg->sn - una;
+        prev = p->prev;
+        if (_itimediff(seg->sn, una) >= 0 && off < bits &&
+            ((const unsigned char*)bitmap)[off >> 3] & (1 << (off & 7))) {
+            ikcp_ack_rate(kcp, seg, current);
+            ikcp_rto_remove(kcp, seg);
+            kcp->snd_ring[seg->sn & kcp->snd_ring_mask] = NULL;
             iqueue_del(p);
             ikcp_segment_delete(kcp, seg);
             kcp->nsnd_buf--;
-        }	else {
-            break;
+            acked++;
+        }	else if (acked > 0) {
+            ikcp_rto_fastack(kcp, seg, acked);
         }
     }
-#endif
 }
 
 
@@ -618,9 +1897,8 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-    struct IQUEUEHEAD *p, *prev;
     IUINT32 sn = newseg->sn;
-    int repeat = 0;
+    IUINT32 idx = sn & kcp->rcv_slot_mask;
 
     if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
         _itimediff(sn, kcp->rcv_nxt) < 0) {
@@ -628,44 +1906,18 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
         return;
     }
 
-    for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-        IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-        prev = p->prev;
-        if (seg->sn == sn) {
-            repeat = 1;
-            break;
-        }
-        if (_itimediff(sn, seg->sn) > 0) {
-            break;
-        }
-    }
-
-    if (repeat == 0) {
+    if (ikcp_slot_test(kcp, idx) == 0) {
         iqueue_init(&newseg->node);
-        iqueue_add(&newseg->node, p);
+        ikcp_slot_set(kcp, idx, newseg);
         kcp->nrcv_buf++;
+        kcp->stats.segs_recv++;
     }	else {
         ikcp_segment_delete(kcp, newseg);
+        kcp->stats.segs_dup++;
     }
 
-#if 0
-    ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-    printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
-    // move available data from rcv_buf -> rcv_queue
-    while (! iqueue_is_empty(&kcp->rcv_buf)) {
-        IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            kcp->rcv_nxt++;
-        }	else {
-            break;
-        }
-    }
+    // move available data from rcv_slots -> rcv_queue
+    ikcp_slot_drain(kcp);
 
 #if 0
     ikcp_qprint("queue", &kcp->rcv_queue);
@@ -679,12 +1931,30 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 }
 
 
+// a new data segment over kcp->mem_limit is dropped without an ack, so
+// the remote sends it again later. the one at rcv_nxt is always taken,
+// the memory may be held by the segments waiting behind it.
+static int ikcp_rcv_full(const ikcpcb *kcp, IUINT32 sn, IUINT32 len)
+{
+    if (kcp->mem_limit == 0 || _itimediff(sn, kcp->rcv_nxt) <= 0)
+        return 0;
+    if (ikcp_slot_test(kcp, sn & kcp->rcv_slot_mask))
+        return 0;
+    return ikcp_mem_over(kcp, (IINT64)(sizeof(IKCPSEG) + len));
+}
+
+
 //---------------------------------------------------------------------
 // input data
 //---------------------------------------------------------------------
 int ikcp_input(ikcpcb *kcp, const char *data, long size)
 {
     IUINT32 una = kcp->snd_una;
+    IUINT32 current = ikcp_now(kcp);
+    IUINT32 acks[64];
+    IKCPHDR hdrs[IKCP_HDR_BATCH];
+    int nacks = 0, nmissing = 0, nhdrs = 0, ihdr = 0;
+    int hr = 0;
 
     if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
         ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
@@ -692,42 +1962,81 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 
     if (data == NULL || size < 24) return 0;
 
+    ikcp_stats_begin(kcp);
+    kcp->stats.in_pkts++;
+    kcp->stats.in_bytes += size;
+
+    kcp->rs.una = una;
+    kcp->rs.acked = 0;
+    kcp->rs.delivered = kcp->delivered;
+    kcp->rs.interval = -1;
+    kcp->rs.rtt = -1;
+
     while (1) {
         IUINT32 ts, sn, len, una, conv;
         IUINT16 wnd;
         IUINT8 cmd, frg;
         IKCPSEG *seg;
+        const IKCPHDR *hdr;
+
+        // headers are decoded and checked a batch ahead, an invalid one
+        // ends the batch and sets hr once the valid ones are processed
+        if (ihdr == nhdrs) {
+            if (hr < 0) break;
+            nhdrs = ikcp_decode_hdrs(data, size, kcp->conv, hdrs,
+                IKCP_HDR_BATCH, &hr);
+            ihdr = 0;
+            if (nhdrs == 0) break;
+        }
 
-        if (size < (int)IKCP_OVERHEAD) break;
-
-        data = ikcp_decode32u(data, &conv);
-        if (conv != kcp->conv) return -1;
-
-        data = ikcp_decode8u(data, &cmd);
-        data = ikcp_decode8u(data, &frg);
-        data = ikcp_decode16u(data, &wnd);
-        data = ikcp_decode32u(data, &ts);
-        data = ikcp_decode32u(data, &sn);
-        data = ikcp_decode32u(data, &una);
-        data = ikcp_decode32u(data, &len);
-
+        hdr = &hdrs[ihdr++];
+        conv = hdr->conv;
+        cmd = hdr->cmd;
+        frg = hdr->frg;
+        wnd = hdr->wnd;
+        ts = hdr->ts;
+        sn = hdr->sn;
+        una = hdr->una;
+        len = hdr->len;
+
+        data += IKCP_OVERHEAD;
         size -= IKCP_OVERHEAD;
 
-        if ((long)size < (long)len) return -2;
-
-        if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-            cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS)
-            return -3;
+        if (cmd != IKCP_CMD_PUSH) {
+            kcp->rmt_wscale = (int)_imin_(frg & IKCP_FRG_WSCALE,
+                IKCP_WSCALE_MAX);
+        }
 
-        kcp->rmt_wnd = wnd;
-        ikcp_parse_una(kcp, una);
+        kcp->rmt_wnd = (IUINT32)wnd << kcp->rmt_wscale;
+        ikcp_parse_una(kcp, una, current);
         ikcp_shrink_buf(kcp);
 
+        if (cmd != IKCP_CMD_PUSH) {
+            kcp->rmt_sack = (frg & IKCP_FRG_SACK)? 1 : 0;
+            // a capable peer still sending plain acks has not heard
+            // from us yet, answer with IKCP_CMD_WINS carrying the flag
+            if (kcp->sack && kcp->rmt_sack && cmd == IKCP_CMD_ACK) {
+                kcp->probe |= IKCP_ASK_TELL;
+            }
+        }
+
         if (cmd == IKCP_CMD_ACK) {
             if (_itimediff(kcp->current, ts) >= 0) {
                 ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
             }
-            ikcp_parse_ack(kcp, sn);
+            switch (ikcp_parse_ack(kcp, sn, current)) {
+            case 1:
+                if (nacks == (int)(sizeof(acks) / sizeof(acks[0]))) {
+                    ikcp_parse_fastack(kcp, acks, nacks, nmissing);
+                    nacks = 0;
+                    nmissing = 0;
+                }
+                acks[nacks++] = sn;
+                break;
+            case 2:
+                nmissing++;
+                break;
+            }
             ikcp_shrink_buf(kcp);
             if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
                 ikcp_log(kcp, IKCP_LOG_IN_DATA,
@@ -736,12 +2045,27 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
                     (long)kcp->rx_rto);
             }
         }
+        else if (cmd == IKCP_CMD_SACK) {
+            if (_itimediff(kcp->current, ts) >= 0) {
+                ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+            }
+            ikcp_parse_sack(kcp, una, data, len, current);
+            ikcp_shrink_buf(kcp);
+            if (ikcp_canlog(kcp, IKCP_LOG_IN_SACK)) {
+                ikcp_log(kcp, IKCP_LOG_IN_SACK,
+                    "input sack: una=%lu bits=%lu rtt=%ld rto=%ld", una,
+                    (unsigned long)len * 8,
+                    (long)_itimediff(kcp->current, ts),
+                    (long)kcp->rx_rto);
+            }
+        }
         else if (cmd == IKCP_CMD_PUSH) {
             if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
                 ikcp_log(kcp, IKCP_LOG_IN_DATA,
                     "input psh: sn=%lu ts=%lu", sn, ts);
             }
-            if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+            if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0 &&
+                !ikcp_rcv_full(kcp, sn, len)) {
                 ikcp_ack_push(kcp, sn, ts);
                 if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
                     seg = ikcp_segment_new(kcp, len);
@@ -759,7 +2083,11 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
                     }
 
                     ikcp_parse_data(kcp, seg);
+                }	else {
+                    kcp->stats.segs_dup++;
                 }
+            }	else {
+                kcp->stats.segs_refused++;
             }
         }
         else if (cmd == IKCP_CMD_WASK) {
@@ -778,14 +2106,46 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
             }
         }
         else {
-            return -3;
+            hr = -3;
+            break;
         }
 
         data += len;
         size -= len;
     }
 
-    if (_itimediff(kcp->snd_una, una) > 0) {
+    ikcp_parse_fastack(kcp, acks, nacks, nmissing);
+
+    if (hr < 0) kcp->stats.input_errors++;
+    ikcp_stats_end(kcp);
+
+    if (hr < 0) return hr;
+
+    if (kcp->rs.acked > 0) {
+        kcp->cc->on_ack(kcp, &kcp->rs);
+    }
+
+    // window freed by acks is used now, not at the next update
+    if (kcp->immediate) ikcp_flush_fresh(kcp);
+
+    return 0;
+}
+
+
+IUINT32 ikcp_getconv(const void *ptr)
+{
+    IUINT32 conv;
+    ikcp_decode32u((const char*)ptr, &conv);
+    return conv;
+}
+
+
+//---------------------------------------------------------------------
+// congestion control: reno
+//---------------------------------------------------------------------
+static void ikcp_reno_on_ack(ikcpcb *kcp, const ikcprate *rs)
+{
+    if (_itimediff(kcp->snd_una, rs->una) > 0) {
         if (kcp->cwnd < kcp->rmt_wnd) {
             IUINT32 mss = kcp->mss;
             if (kcp->cwnd < kcp->ssthresh) {
@@ -804,128 +2164,664 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
             }
         }
     }
-
-    return 0;
 }
 
-
-//---------------------------------------------------------------------
-// ikcp_encode_seg
-//---------------------------------------------------------------------
-static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
+static void ikcp_reno_on_loss(ikcpcb *kcp, int reason, IUINT32 count)
+{
+    if (reason == IKCP_LOSS_FAST) {
+        IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+        kcp->ssthresh = inflight / 2;
+        if (kcp->ssthresh < IKCP_THRESH_MIN)
+            kcp->ssthresh = IKCP_THRESH_MIN;
+        kcp->cwnd = kcp->ssthresh + (IUINT32)kcp->fastresend;
+        kcp->incr = kcp->cwnd * kcp->mss;
+    }
+    else if (reason == IKCP_LOSS_TIMEOUT) {
+        IUINT32 cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+        if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+        kcp->ssthresh = cwnd / 2;
+        if (kcp->ssthresh < IKCP_THRESH_MIN)
+            kcp->ssthresh = IKCP_THRESH_MIN;
+        kcp->cwnd = 1;
+        kcp->incr = kcp->mss;
+    }
+    (void)count;
+}
+
+const ikcpcc ikcp_cc_reno = {
+    "reno",
+    NULL,
+    NULL,
+    ikcp_reno_on_ack,
+    ikcp_reno_on_loss,
+    NULL,
+    NULL,
+};
+
+
+//---------------------------------------------------------------------
+// congestion control: bbr
+// bandwidth is the max delivery rate of the last rounds, min rtt the
+// lowest rtt of the last seconds. startup doubles the rate each round
+// until it stops growing, drain empties the queue it built, probe_bw
+// cycles the pacing gain around the estimate and probe_rtt shrinks
+// cwnd for a moment whenever min rtt got stale.
+//---------------------------------------------------------------------
+#define IKCP_BBR_UNIT		256
+#define IKCP_BBR_HIGH_GAIN	739		// 2/ln(2), doubles each round
+#define IKCP_BBR_DRAIN_GAIN	88		// 1/high_gain
+#define IKCP_BBR_CWND_GAIN	512
+#define IKCP_BBR_CWND_MIN	4
+#define IKCP_BBR_BW_ROUNDS	10		// max bandwidth window in rounds
+#define IKCP_BBR_RTT_WIN	10000	// min rtt window in millisec
+#define IKCP_BBR_RTT_PROBE	200		// millisec spent in probe_rtt
+#define IKCP_BBR_FULL_ROUNDS	3		// rounds without growth to leave startup
+#define IKCP_BBR_CYCLE		8
+
+enum { IKCP_BBR_STARTUP, IKCP_BBR_DRAIN, IKCP_BBR_PROBE_BW, IKCP_BBR_PROBE_RTT };
+
+static const IUINT32 ikcp_bbr_cycle[IKCP_BBR_CYCLE] = {
+    320, 192, 256, 256, 256, 256, 256, 256,
+};
+
+struct IKCPBBR
+{
+    int mode;
+    IUINT32 pacing_gain, cwnd_gain;
+    IUINT32 round, next_delivered;
+    struct { IUINT32 round, bw; } bw[3];  // segments/sec, windowed max:
+                                        // best, 2nd and 3rd best later
+    IUINT32 min_rtt, min_rtt_ts;
+    IUINT32 full_bw, full_cnt;
+    int full;
+    int cycle;
+    IUINT32 cycle_ts;
+    IUINT32 probe_rtt_done;             // 0 until inflight got small
+    IUINT32 prior_cwnd;                 // cwnd to restore, 0 for none
+};
+
+static inline IUINT32 ikcp_bbr_max_bw(const struct IKCPBBR *bbr)
+{
+    return bbr->bw[0].bw;
+}
+
+// running max over IKCP_BBR_BW_ROUNDS rounds (the minmax of linux): only
+// a sample replaces an estimate, so it never empties between samples
+static void ikcp_bbr_bw_sample(struct IKCPBBR *bbr, IUINT32 bw)
+{
+    IUINT32 win = IKCP_BBR_BW_ROUNDS, round = bbr->round;
+    int i;
+
+    if (bw >= bbr->bw[0].bw || round - bbr->bw[2].round > win) {
+        for (i = 0; i < 3; i++) {
+            bbr->bw[i].round = round;
+            bbr->bw[i].bw = bw;
+        }
+        return;
+    }
+    if (bw >= bbr->bw[1].bw) {
+        bbr->bw[1].round = bbr->bw[2].round = round;
+        bbr->bw[1].bw = bbr->bw[2].bw = bw;
+    }
+    else if (bw >= bbr->bw[2].bw) {
+        bbr->bw[2].round = round;
+        bbr->bw[2].bw = bw;
+    }
+
+    // the best one expired: the later ones move up, twice if needed
+    if (round - bbr->bw[0].round > win) {
+        for (i = 0; i < 2 && round - bbr->bw[0].round > win; i++) {
+            bbr->bw[0] = bbr->bw[1];
+            bbr->bw[1] = bbr->bw[2];
+            bbr->bw[2].round = round;
+            bbr->bw[2].bw = bw;
+        }
+    }
+    // keep the later ones spread over the window
+    else if (bbr->bw[1].round == bbr->bw[0].round &&
+        round - bbr->bw[0].round > win / 4) {
+        bbr->bw[1].round = bbr->bw[2].round = round;
+        bbr->bw[1].bw = bbr->bw[2].bw = bw;
+    }
+    else if (bbr->bw[2].round == bbr->bw[1].round &&
+        round - bbr->bw[0].round > win / 2) {
+        bbr->bw[2].round = round;
+        bbr->bw[2].bw = bw;
+    }
+}
+
+// segments in the pipe at 'gain' times the estimated rate, 0 if unknown
+static IUINT32 ikcp_bbr_bdp(const ikcpcb *kcp, IUINT32 gain)
+{
+    const struct IKCPBBR *bbr = (const struct IKCPBBR*)kcp->cc_state;
+    IUINT64 bdp, unit = (IUINT64)1000 * kcp->clock * IKCP_BBR_UNIT;
+    IUINT32 bw = ikcp_bbr_max_bw(bbr);
+    if (bw == 0 || bbr->min_rtt == 0xffffffff) return 0;
+    bdp = (IUINT64)bw * bbr->min_rtt * gain;
+    bdp = (bdp + unit - 1) / unit;
+    return (bdp > 0xffffff)? 0xffffff : (IUINT32)bdp;
+}
+
+// segments sent and not acked yet: those pacing still holds at the tail
+// of snd_buf are not in the pipe
+static IUINT32 ikcp_bbr_inflight(const ikcpcb *kcp)
+{
+    const struct IQUEUEHEAD *p;
+    IUINT32 inflight = kcp->nsnd_buf;
+    for (p = kcp->snd_buf.prev; p != &kcp->snd_buf; p = p->prev) {
+        if (iqueue_entry(p, IKCPSEG, node)->xmit != 0) break;
+        inflight--;
+    }
+    return inflight;
+}
+
+static void ikcp_bbr_set_mode(struct IKCPBBR *bbr, int mode, IUINT32 current)
+{
+    bbr->mode = mode;
+    if (mode == IKCP_BBR_STARTUP) {
+        bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+        bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+    }
+    else if (mode == IKCP_BBR_DRAIN) {
+        bbr->pacing_gain = IKCP_BBR_DRAIN_GAIN;
+        bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+    }
+    else if (mode == IKCP_BBR_PROBE_BW) {
+        // start anywhere but in the draining phase
+        bbr->cycle = current % (IKCP_BBR_CYCLE - 1);
+        if (bbr->cycle > 0) bbr->cycle++;
+        bbr->cycle_ts = current;
+        bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle];
+        bbr->cwnd_gain = IKCP_BBR_CWND_GAIN;
+    }
+    else {
+        bbr->pacing_gain = IKCP_BBR_UNIT;
+        bbr->cwnd_gain = IKCP_BBR_UNIT;
+        bbr->probe_rtt_done = 0;
+    }
+}
+
+static int ikcp_bbr_init(ikcpcb *kcp)
+{
+    struct IKCPBBR *bbr;
+    bbr = (struct IKCPBBR*)ikcp_malloc(sizeof(struct IKCPBBR));
+    if (bbr == NULL) return -1;
+    memset(bbr, 0, sizeof(struct IKCPBBR));
+    bbr->next_delivered = kcp->delivered;
+    bbr->min_rtt = 0xffffffff;
+    bbr->min_rtt_ts = kcp->current;
+    ikcp_bbr_set_mode(bbr, IKCP_BBR_STARTUP, kcp->current);
+    if (kcp->cwnd < IKCP_BBR_CWND_MIN) {
+        kcp->cwnd = IKCP_BBR_CWND_MIN;
+        kcp->incr = kcp->cwnd * kcp->mss;
+    }
+    kcp->cc_state = bbr;
+    return 0;
+}
+
+static void ikcp_bbr_release(ikcpcb *kcp)
+{
+    if (kcp->cc_state) {
+        ikcp_free(kcp->cc_state);
+        kcp->cc_state = NULL;
+    }
+}
+
+static void ikcp_bbr_on_ack(ikcpcb *kcp, const ikcprate *rs)
+{
+    struct IKCPBBR *bbr = (struct IKCPBBR*)kcp->cc_state;
+    IUINT32 current = kcp->current;
+    IUINT32 inflight = ikcp_bbr_inflight(kcp);
+    IUINT32 bw, bdp, target;
+    int round_start = 0;
+    int rtt_expired;
+
+    // a round ends once a segment sent after it began is acked, only a
+    // segment sent once tells when that was
+    if (rs->interval >= 0 &&
+        _itimediff(rs->delivered, bbr->next_delivered) >= 0) {
+        bbr->next_delivered = kcp->delivered;
+        bbr->round++;
+        round_start = 1;
+    }
+
+    rtt_expired = _itimediff(current, bbr->min_rtt_ts) >
+        (IINT32)(IKCP_BBR_RTT_WIN * kcp->clock);
+    if (rs->rtt >= 0 && ((IUINT32)rs->rtt <= bbr->min_rtt || rtt_expired)) {
+        bbr->min_rtt = _imax_((IUINT32)rs->rtt, 1);
+        bbr->min_rtt_ts = current;
+    }
+
+    // acks compressed below min rtt would overstate the rate
+    if (rs->interval > 0 && (IUINT32)rs->interval >= bbr->min_rtt) {
+        bw = (IUINT32)((IUINT64)(kcp->delivered - rs->delivered) * 1000 *
+            kcp->clock / (IUINT32)rs->interval);
+        if (bw > 0) ikcp_bbr_bw_sample(bbr, bw);
+    }
+
+    bw = ikcp_bbr_max_bw(bbr);
+
+    if (round_start && !bbr->full && bw > 0) {
+        if (bw >= bbr->full_bw + bbr->full_bw / 4) {
+            bbr->full_bw = bw;
+            bbr->full_cnt = 0;
+        }
+        else if (++bbr->full_cnt >= IKCP_BBR_FULL_ROUNDS) {
+            bbr->full = 1;
+        }
+    }
+
+    if (bbr->mode == IKCP_BBR_STARTUP && bbr->full) {
+        ikcp_bbr_set_mode(bbr, IKCP_BBR_DRAIN, current);
+    }
+    if (bbr->mode == IKCP_BBR_DRAIN &&
+        inflight <= ikcp_bbr_bdp(kcp, IKCP_BBR_UNIT)) {
+        ikcp_bbr_set_mode(bbr, IKCP_BBR_PROBE_BW, current);
+    }
+    if (bbr->mode == IKCP_BBR_PROBE_BW) {
+        // one phase per min rtt, leave the draining one early when empty
+        if (_itimediff(current, bbr->cycle_ts) > (IINT32)bbr->min_rtt ||
+            (bbr->pacing_gain < IKCP_BBR_UNIT &&
+             inflight <= ikcp_bbr_bdp(kcp, IKCP_BBR_UNIT))) {
+            bbr->cycle = (bbr->cycle + 1) % IKCP_BBR_CYCLE;
+            bbr->cycle_ts = current;
+            bbr->pacing_gain = ikcp_bbr_cycle[bbr->cycle];
+        }
+    }
+
+    if (rtt_expired && bbr->mode != IKCP_BBR_PROBE_RTT) {
+        if (bbr->prior_cwnd == 0) bbr->prior_cwnd = kcp->cwnd;
+        ikcp_bbr_set_mode(bbr, IKCP_BBR_PROBE_RTT, current);
+    }
+
+    if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+        kcp->cwnd = IKCP_BBR_CWND_MIN;
+        if (bbr->probe_rtt_done == 0 && inflight <= IKCP_BBR_CWND_MIN) {
+            bbr->probe_rtt_done = current + IKCP_BBR_RTT_PROBE * kcp->clock;
+            if (bbr->probe_rtt_done == 0) bbr->probe_rtt_done = 1;
+        }
+        else if (bbr->probe_rtt_done != 0 &&
+            _itimediff(current, bbr->probe_rtt_done) >= 0) {
+            bbr->min_rtt_ts = current;
+            kcp->cwnd = _imax_(kcp->cwnd, bbr->prior_cwnd);
+            bbr->prior_cwnd = 0;
+            ikcp_bbr_set_mode(bbr, bbr->full? IKCP_BBR_PROBE_BW :
+                IKCP_BBR_STARTUP, current);
+        }
+        kcp->incr = kcp->cwnd * kcp->mss;
+        return;
+    }
+
+    // back from a timeout once una moves again
+    if (bbr->prior_cwnd != 0 && _itimediff(kcp->snd_una, rs->una) > 0) {
+        kcp->cwnd = _imax_(kcp->cwnd, bbr->prior_cwnd);
+        bbr->prior_cwnd = 0;
+    }
+
+    bdp = ikcp_bbr_bdp(kcp, bbr->cwnd_gain);
+    target = _imax_(bdp, IKCP_BBR_CWND_MIN);
+    if (bbr->full) {
+        kcp->cwnd = _imin_(kcp->cwnd + rs->acked, target);
+    }
+    else if (kcp->cwnd < target || bdp == 0) {
+        kcp->cwnd += rs->acked;
+    }
+    if (kcp->cwnd < IKCP_BBR_CWND_MIN) kcp->cwnd = IKCP_BBR_CWND_MIN;
+    kcp->incr = kcp->cwnd * kcp->mss;
+}
+
+// losses are no congestion signal, only a timeout falls back to what is
+// still believed in flight until the next acked segment
+static void ikcp_bbr_on_loss(ikcpcb *kcp, int reason, IUINT32 count)
+{
+    struct IKCPBBR *bbr = (struct IKCPBBR*)kcp->cc_state;
+    IUINT32 inflight = ikcp_bbr_inflight(kcp);
+    if (reason != IKCP_LOSS_TIMEOUT || bbr->mode == IKCP_BBR_PROBE_RTT)
+        return;
+    if (bbr->prior_cwnd == 0) bbr->prior_cwnd = kcp->cwnd;
+    inflight = (inflight > count)? inflight - count : 0;
+    kcp->cwnd = _imax_(inflight, IKCP_BBR_CWND_MIN);
+    kcp->incr = kcp->cwnd * kcp->mss;
+}
+
+static IUINT32 ikcp_bbr_pacing_rate(const ikcpcb *kcp)
+{
+    const struct IKCPBBR *bbr = (const struct IKCPBBR*)kcp->cc_state;
+    IUINT64 rate = ikcp_bbr_max_bw(bbr);
+    if (rate > 0) {
+        rate = rate * kcp->mss;
+    }
+    else if (kcp->rx_srtt > 0) {
+        rate = (IUINT64)kcp->cwnd * kcp->mss * 1000 * kcp->clock /
+            (IUINT32)kcp->rx_srtt;
+    }
+    rate = rate * bbr->pacing_gain / IKCP_BBR_UNIT;
+    return (rate > 0xffffffff)? 0xffffffff : (IUINT32)rate;
+}
+
+const ikcpcc ikcp_cc_bbr = {
+    "bbr",
+    ikcp_bbr_init,
+    ikcp_bbr_release,
+    ikcp_bbr_on_ack,
+    ikcp_bbr_on_loss,
+    NULL,
+    ikcp_bbr_pacing_rate,
+};
+
+
+//---------------------------------------------------------------------
+// ikcp_encode_seg
+//---------------------------------------------------------------------
+static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
+{
+    return ikcp_encode_hdr(ptr, seg->conv, seg->cmd, seg->frg, seg->wnd,
+        seg->ts, seg->sn, seg->una, seg->len);
+}
+
+// a run of acks sharing everything but sn/ts, which come from acklist
+// pairs: the first 8 bytes of the header are built once, and each pair
+// is swapped into place next to them.
+static char *ikcp_encode_acks(char *ptr, const IKCPSEG *seg,
+    const IUINT32 *acklist, int count)
+{
+#if IKCP_SSE2
+    IUINT32 word = (seg->cmd & 0xff) | ((seg->frg & 0xff) << 8) |
+        (seg->wnd << 16);
+    __m128i head = _mm_set_epi32(0, 0, (int)word, (int)seg->conv);
+    __m128i tail = _mm_set_epi32(0, 0, (int)seg->len, (int)seg->una);
+    int i;
+    for (i = 0; i < count; i++, acklist += 2, ptr += IKCP_OVERHEAD) {
+        __m128i pair = _mm_loadl_epi64((const __m128i*)acklist);
+        pair = _mm_shuffle_epi32(pair, _MM_SHUFFLE(3, 2, 0, 1));
+        _mm_storeu_si128((__m128i*)ptr, _mm_unpacklo_epi64(head, pair));
+        _mm_storel_epi64((__m128i*)(ptr + 16), tail);
+    }
+#else
+    int i;
+    for (i = 0; i < count; i++, acklist += 2) {
+        ptr = ikcp_encode_hdr(ptr, seg->conv, seg->cmd, seg->frg, seg->wnd,
+            acklist[1], acklist[0], seg->una, seg->len);
+    }
+#endif
+    return ptr;
+}
+
+//---------------------------------------------------------------------
+// pacing: token bucket in bytes * 1000, filled by pace_rate each ms and
+// holding at most one interval worth, a segment may overdraw it. times
+// are in ticks, kcp->clock of them per ms.
+//---------------------------------------------------------------------
+static IUINT32 ikcp_pace_target(const ikcpcb *kcp)
+{
+    IUINT32 cwnd;
+    IUINT64 rate;
+    if (kcp->pace_conf > 0) return kcp->pace_conf;
+    if (kcp->cc->pacing_rate) return kcp->cc->pacing_rate(kcp);
+    if (kcp->rx_srtt <= 0) return 0;
+    cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+    if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+    // ahead of the window: twice in slow start, 1.25 times after
+    cwnd = (kcp->nocwnd == 0 && kcp->cwnd < kcp->ssthresh)?
+        cwnd * 2 : cwnd + cwnd / 4;
+    rate = (IUINT64)cwnd * kcp->mss * 1000 * kcp->clock / (IUINT32)kcp->rx_srtt;
+    return (rate > 0xffffffff)? 0xffffffff : (IUINT32)rate;
+}
+
+static void ikcp_pace_refill(ikcpcb *kcp, IUINT32 current)
+{
+    IINT32 elapsed = _itimediff(current, kcp->pace_last);
+    IINT64 burst;
+
+    kcp->pace_last = current;
+    kcp->pace_held = 0;
+    kcp->pace_rate = ikcp_pace_target(kcp);
+    if (kcp->pace_rate == 0) return;
+
+    burst = (IINT64)kcp->pace_rate * kcp->interval / kcp->clock;
+    if (burst < (IINT64)kcp->mtu * 1000) burst = (IINT64)kcp->mtu * 1000;
+    if (elapsed > (IINT32)kcp->interval) elapsed = kcp->interval;
+    if (elapsed > 0) {
+        kcp->pace_tokens += (IINT64)kcp->pace_rate * elapsed / kcp->clock;
+    }
+    if (kcp->pace_tokens > burst) kcp->pace_tokens = burst;
+}
+
+static void ikcp_pace_hold(ikcpcb *kcp, IUINT32 current)
+{
+    kcp->pace_held = 1;
+    kcp->pace_next = current + 1 +
+        (IUINT32)(-kcp->pace_tokens * kcp->clock / (IINT64)kcp->pace_rate);
+}
+
+static inline int ikcp_pace_empty(const ikcpcb *kcp)
+{
+    return kcp->pacing && kcp->pace_rate > 0 && kcp->pace_tokens <= 0;
+}
+
+// the receive window to advertise, in units of 1 << kcp->wscale. under
+// kcp->mem_limit, only as many segments beyond those already held as
+// the memory left can take.
+static int ikcp_wnd_unused(const ikcpcb *kcp)
+{
+    IUINT32 wnd = 0;
+    if (kcp->nrcv_que < kcp->rcv_wnd) {
+        wnd = kcp->rcv_wnd - kcp->nrcv_que;
+    }
+    if (kcp->mem_limit > 0) {
+        IUINT64 room = 0;
+        if (kcp->mem_used < kcp->mem_limit) {
+            room = (kcp->mem_limit - kcp->mem_used) /
+                (sizeof(IKCPSEG) + kcp->mss);
+        }
+        if (room < wnd) wnd = _imin_(wnd, kcp->nrcv_buf + (IUINT32)room);
+    }
+    return (int)_imin_(wnd >> kcp->wscale, 0xffff);
+}
+
+
+//---------------------------------------------------------------------
+// datagram assembly: headers are encoded at kcp->dgram, payloads are
+// copied behind them, or referenced as iov slices when outputv is set.
+// kcp->dgram is kcp->buffer, or the next free slot of kcp->batch.
+//---------------------------------------------------------------------
+static inline int ikcp_dgram_gather(const ikcpcb *kcp)
+{
+    return kcp->batch == NULL && kcp->outputv != NULL;
+}
+
+static char *ikcp_dgram_begin(ikcpcb *kcp)
+{
+    if (kcp->batch != NULL) {
+        ikcpbatch *batch = kcp->batch;
+        if (batch->count >= batch->capacity) ikcp_batch_flush(batch);
+        kcp->dgram = batch->dgrams[batch->count].data;
+    }	else {
+        kcp->dgram = kcp->buffer;
+    }
+    kcp->niov = 0;
+    kcp->iovlen = 0;
+    kcp->iovhead = kcp->dgram;
+    return kcp->dgram;
+}
+
+static inline int ikcp_dgram_size(const ikcpcb *kcp, const char *ptr)
+{
+    return (int)(ptr - kcp->dgram) + kcp->iovlen;
+}
+
+static inline void ikcp_dgram_head(ikcpcb *kcp, char *ptr)
+{
+    if (ptr > kcp->iovhead) {
+        kcp->iov[kcp->niov].base = kcp->iovhead;
+        kcp->iov[kcp->niov].len = (int)(ptr - kcp->iovhead);
+        kcp->niov++;
+        kcp->iovhead = ptr;
+    }
+}
+
+// send the datagram being built, returns the new write position
+static char *ikcp_dgram_output(ikcpcb *kcp, char *ptr)
+{
+    if (ikcp_dgram_size(kcp, ptr) > 0) {
+        kcp->stats.out_pkts++;
+        kcp->stats.out_bytes += ikcp_dgram_size(kcp, ptr);
+    }
+    if (kcp->batch != NULL) {
+        ikcpbatch *batch = kcp->batch;
+        struct IKCPDGRAM *dgram = &batch->dgrams[batch->count];
+        int size = (int)(ptr - kcp->dgram);
+        if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+            ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
+        }
+        if (size > 0) {
+            dgram->len = size;
+            dgram->kcp = kcp;
+            dgram->user = kcp->user;
+            batch->count++;
+        }
+        return ikcp_dgram_begin(kcp);
+    }
+    if (!ikcp_dgram_gather(kcp)) {
+        ikcp_output(kcp, kcp->buffer, (int)(ptr - kcp->buffer));
+    }	else {
+        ikcp_dgram_head(kcp, ptr);
+        ikcp_outputv(kcp, kcp->iov, kcp->niov, ikcp_dgram_size(kcp, ptr));
+        kcp->niov = 0;
+        kcp->iovlen = 0;
+        kcp->iovhead = kcp->buffer;
+    }
+    return kcp->buffer;
+}
+
+// make room for 'need' bytes, sending the current datagram if it is full
+static inline char *ikcp_dgram_reserve(ikcpcb *kcp, char *ptr, int need)
 {
-    ptr = ikcp_encode32u(ptr, seg->conv);
-    ptr = ikcp_encode8u(ptr, (IUINT8)seg->cmd);
-    ptr = ikcp_encode8u(ptr, (IUINT8)seg->frg);
-    ptr = ikcp_encode16u(ptr, (IUINT16)seg->wnd);
-    ptr = ikcp_encode32u(ptr, seg->ts);
-    ptr = ikcp_encode32u(ptr, seg->sn);
-    ptr = ikcp_encode32u(ptr, seg->una);
-    ptr = ikcp_encode32u(ptr, seg->len);
+    if (ikcp_dgram_size(kcp, ptr) + need > (int)kcp->mtu) {
+        ptr = ikcp_dgram_output(kcp, ptr);
+    }
     return ptr;
 }
 
-static int ikcp_wnd_unused(const ikcpcb *kcp)
+static char *ikcp_dgram_payload(ikcpcb *kcp, char *ptr, const IKCPSEG *seg)
 {
-    if (kcp->nrcv_que < kcp->rcv_wnd) {
-        return kcp->rcv_wnd - kcp->nrcv_que;
+    if (seg->len == 0) {
+        return ptr;
     }
-    return 0;
+    if (!ikcp_dgram_gather(kcp)) {
+        memcpy(ptr, seg->data, seg->len);
+        return ptr + seg->len;
+    }
+    ikcp_dgram_head(kcp, ptr);
+    kcp->iov[kcp->niov].base = seg->data;
+    kcp->iov[kcp->niov].len = (int)seg->len;
+    kcp->niov++;
+    kcp->iovlen += seg->len;
+    return ptr;
 }
 
 
-//---------------------------------------------------------------------
-// ikcp_flush
-//---------------------------------------------------------------------
-void ikcp_flush(ikcpcb *kcp)
+// one IKCP_CMD_SACK for the whole acklist: sn/ts echo the newest ack for
+// rtt sampling, the payload is the rcv_slots bitmap from rcv_nxt on,
+// trimmed after its last set byte and to what fits in one datagram.
+static char *ikcp_flush_sack(ikcpcb *kcp, char *ptr, const IKCPSEG *ack)
 {
-    IUINT32 current = kcp->current;
-    char *buffer = kcp->buffer;
-    char *ptr = buffer;
-    int count, size, i;
-    IUINT32 resent, cwnd;
-    IUINT32 rtomin;
-    struct IQUEUEHEAD *p;
-    int change = 0;
-    int lost = 0;
-    IKCPSEG seg;
-
-    // 'ikcp_update' haven't been called.
-    if (kcp->updated == 0) return;
-
-    seg.conv = kcp->conv;
-    seg.cmd = IKCP_CMD_ACK;
-    seg.frg = 0;
-    seg.wnd = ikcp_wnd_unused(kcp);
-    seg.una = kcp->rcv_nxt;
-    seg.len = 0;
-    seg.sn = 0;
-    seg.ts = 0;
-
-    // flush acknowledges
-    count = kcp->ackcount;
-    for (i = 0; i < count; i++) {
-        size = (int)(ptr - buffer);
-        if ((int)(size + IKCP_OVERHEAD) > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
+    IKCPSEG seg = *ack;
+    IUINT32 limit = _imin_(kcp->rcv_wnd, kcp->mss * 8);
+    IUINT32 nbyte = (limit + 7) / 8;
+    IUINT32 i, k, len = 0;
+    char *bitmap;
+
+    seg.cmd = IKCP_CMD_SACK;
+    ikcp_ack_get(kcp, kcp->ackcount - 1, &seg.sn, &seg.ts);
+
+    // worst case size first, the real length is known after encoding
+    ptr = ikcp_dgram_reserve(kcp, ptr, IKCP_OVERHEAD + nbyte);
+    bitmap = ptr + IKCP_OVERHEAD;
+
+    for (i = 0; kcp->nrcv_buf > 0 && i < limit; i += 32) {
+        IUINT32 bits = ikcp_slot_word(kcp, kcp->rcv_nxt + i);
+        if (limit - i < 32) bits &= ((IUINT32)1 << (limit - i)) - 1;
+        for (k = 0; k < 4 && i / 8 + k < nbyte; k++) {
+            unsigned char c = (unsigned char)(bits >> (k * 8));
+            bitmap[i / 8 + k] = (char)c;
+            if (c != 0) len = i / 8 + k + 1;
         }
-        ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-        ptr = ikcp_encode_seg(ptr, &seg);
     }
 
-    kcp->ackcount = 0;
+    seg.len = len;
+    ptr = ikcp_encode_seg(ptr, &seg);
 
-    // probe window size (if remote window size equals zero)
-    if (kcp->rmt_wnd == 0) {
-        if (kcp->probe_wait == 0) {
-            kcp->probe_wait = IKCP_PROBE_INIT;
-            kcp->ts_probe = kcp->current + kcp->probe_wait;
-        }
-        else {
-            if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
-                if (kcp->probe_wait < IKCP_PROBE_INIT)
-                    kcp->probe_wait = IKCP_PROBE_INIT;
-                kcp->probe_wait += kcp->probe_wait / 2;
-                if (kcp->probe_wait > IKCP_PROBE_LIMIT)
-                    kcp->probe_wait = IKCP_PROBE_LIMIT;
-                kcp->ts_probe = kcp->current + kcp->probe_wait;
-                kcp->probe |= IKCP_ASK_SEND;
-            }
-        }
-    }	else {
-        kcp->ts_probe = 0;
-        kcp->probe_wait = 0;
+    if (ikcp_canlog(kcp, IKCP_LOG_OUT_SACK)) {
+        ikcp_log(kcp, IKCP_LOG_OUT_SACK, "output sack: una=%lu acks=%lu "
+            "bytes=%lu", seg.una, (unsigned long)kcp->ackcount,
+            (unsigned long)len);
     }
 
-    // flush window probing commands
-    if (kcp->probe & IKCP_ASK_SEND) {
-        seg.cmd = IKCP_CMD_WASK;
-        size = (int)(ptr - buffer);
-        if ((int)(size + IKCP_OVERHEAD) > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
-        ptr = ikcp_encode_seg(ptr, &seg);
+    return ptr + len;
+}
+
+
+static int ikcp_sn_compare(const void *a, const void *b)
+{
+    return _itimediff((*(IKCPSEG* const*)a)->sn, (*(IKCPSEG* const*)b)->sn);
+}
+
+// send a data segment and schedule its retransmit
+static char *ikcp_flush_seg(ikcpcb *kcp, char *ptr, IKCPSEG *segment,
+    IUINT32 wnd)
+{
+    int need;
+    segment->ts = kcp->current;
+    segment->wnd = wnd;
+    segment->una = kcp->rcv_nxt;
+    segment->delivered = kcp->delivered;
+    segment->delivered_ts = kcp->delivered_ts;
+
+    if (kcp->cc->on_send) {
+        kcp->cc->on_send(kcp, segment);
     }
 
-    // flush window probing commands
-    if (kcp->probe & IKCP_ASK_TELL) {
-        seg.cmd = IKCP_CMD_WINS;
-        size = (int)(ptr - buffer);
-        if ((int)(size + IKCP_OVERHEAD) > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
-        ptr = ikcp_encode_seg(ptr, &seg);
+    need = IKCP_OVERHEAD + segment->len;
+    if (kcp->pacing) kcp->pace_tokens -= (IINT64)need * 1000;
+    ptr = ikcp_dgram_reserve(kcp, ptr, need);
+    ptr = ikcp_encode_seg(ptr, segment);
+    ptr = ikcp_dgram_payload(kcp, ptr, segment);
+
+    if (segment->xmit >= kcp->dead_link) {
+        kcp->state = -1;
     }
 
-    kcp->probe = 0;
+    ikcp_heap_push(kcp, segment);
+    return ptr;
+}
+
+
+//---------------------------------------------------------------------
+// data segments: move what the window allows from snd_queue to snd_buf
+// and send what is due, found in the retransmit heap and at the tail of
+// snd_buf, never by a walk over all of it. 'fresh' only sends the
+// segments never sent.
+//---------------------------------------------------------------------
+static void ikcp_flush_data(ikcpcb *kcp, char *ptr, IUINT32 wnd, int fresh)
+{
+    IUINT32 current = kcp->current;
+    IUINT32 resent, cwnd;
+    IUINT32 rtomin;
+    struct IQUEUEHEAD *p;
+    IUINT32 change = 0;
+    IUINT32 lost = 0;
+    IKCPSEG **due;
+    IUINT32 n, i;
+    int held = 0;
 
     // calculate window size
     cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
     if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
 
+    // delivery rate intervals start when sending out of idle
+    if (kcp->nsnd_buf == 0) kcp->delivered_ts = current;
+
     // move data from snd_queue to snd_buf
     while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
         IKCPSEG *newseg;
@@ -940,7 +2836,7 @@ void ikcp_flush(ikcpcb *kcp)
 
         newseg->conv = kcp->conv;
         newseg->cmd = IKCP_CMD_PUSH;
-        newseg->wnd = seg.wnd;
+        newseg->wnd = wnd;
         newseg->ts = current;
         newseg->sn = kcp->snd_nxt++;
         newseg->una = kcp->rcv_nxt;
@@ -948,24 +2844,52 @@ void ikcp_flush(ikcpcb *kcp)
         newseg->rto = kcp->rx_rto;
         newseg->fastack = 0;
         newseg->xmit = 0;
+        newseg->heap = 0;
+        newseg->fast = 0;
+
+        assert(kcp->snd_ring[newseg->sn & kcp->snd_ring_mask] == NULL);
+        kcp->snd_ring[newseg->sn & kcp->snd_ring_mask] = newseg;
     }
 
     // calculate resent
     resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
     rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
 
-    // flush data segments
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-        IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
-        int needsend = 0;
-        if (segment->xmit == 0) {
-            needsend = 1;
-            segment->xmit++;
-            segment->rto = kcp->rx_rto;
-            segment->resendts = current + segment->rto + rtomin;
+    if (kcp->pacing) ikcp_pace_refill(kcp, current);
+
+    // retransmits first: the expired and the fast resend segments leave
+    // the heap for the slots it frees behind rto_count, and go out in sn
+    // order. each goes back in as it is handled, into the very slot it
+    // is read from.
+    n = 0;
+    while (!fresh && kcp->rto_count > 0 &&
+        _itimediff(current, kcp->rto_heap[1]->resendts) >= 0) {
+        IKCPSEG *segment = kcp->rto_heap[1];
+        ikcp_heap_remove(kcp, segment);
+        kcp->rto_heap[kcp->rto_count + 1] = segment;
+        n++;
+    }
+    for (i = kcp->rto_nfast; !fresh && i > 0; i--) {
+        IKCPSEG *segment = kcp->rto_fast[i];
+        segment->fast = 0;
+        if (segment->heap != 0) {
+            ikcp_heap_remove(kcp, segment);
+            kcp->rto_heap[kcp->rto_count + 1] = segment;
+            n++;
+        }
+    }
+    if (!fresh) kcp->rto_nfast = 0;
+    due = kcp->rto_heap + kcp->rto_count + 1;
+    if (n > 1) qsort(due, n, sizeof(IKCPSEG*), ikcp_sn_compare);
+
+    for (i = 0; i < n; i++) {
+        IKCPSEG *segment = due[i];
+        // out of tokens: this and the later segments wait for pace_next
+        if (held || ikcp_pace_empty(kcp)) {
+            held = 1;
+            ikcp_heap_push(kcp, segment);
         }
         else if (_itimediff(current, segment->resendts) >= 0) {
-            needsend = 1;
             segment->xmit++;
             kcp->xmit++;
             if (kcp->nodelay == 0) {
@@ -974,82 +2898,175 @@ void ikcp_flush(ikcpcb *kcp)
                 segment->rto += kcp->rx_rto / 2;
             }
             segment->resendts = current + segment->rto;
-            lost = 1;
+            lost++;
+            ptr = ikcp_flush_seg(kcp, ptr, segment, wnd);
         }
         else if (segment->fastack >= resent) {
-            needsend = 1;
             segment->xmit++;
             segment->fastack = 0;
             segment->resendts = current + segment->rto;
             change++;
+            ptr = ikcp_flush_seg(kcp, ptr, segment, wnd);
+        }
+        else {
+            // fastresend was raised since
+            ikcp_heap_push(kcp, segment);
         }
+        // fast acks kept over a timeout or a hold count on the next flush
+        if (segment->fastack >= resent) {
+            ikcp_fast_push(kcp, segment);
+        }
+    }
 
-        if (needsend) {
-            int size, need;
-            segment->ts = current;
-            segment->wnd = seg.wnd;
-            segment->una = kcp->rcv_nxt;
+    // then the segments never sent, the tail of snd_buf
+    p = &kcp->snd_buf;
+    while (!held && p->prev != &kcp->snd_buf &&
+        iqueue_entry(p->prev, IKCPSEG, node)->xmit == 0) {
+        p = p->prev;
+    }
+    for (; !held && p != &kcp->snd_buf; p = p->next) {
+        IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
+        if (ikcp_pace_empty(kcp)) {
+            held = 1;
+            break;
+        }
+        segment->xmit++;
+        segment->rto = kcp->rx_rto;
+        segment->resendts = current + segment->rto + rtomin;
+        ptr = ikcp_flush_seg(kcp, ptr, segment, wnd);
+        kcp->stats.segs_sent++;
+    }
 
-            size = (int)(ptr - buffer);
-            need = IKCP_OVERHEAD + segment->len;
+    if (held) ikcp_pace_hold(kcp, current);
 
-            if (size + need > (int)kcp->mtu) {
-                ikcp_output(kcp, buffer, size);
-                ptr = buffer;
-            }
+    // flash remain segments
+    if (ikcp_dgram_size(kcp, ptr) > 0) {
+        ikcp_dgram_output(kcp, ptr);
+    }
 
-            ptr = ikcp_encode_seg(ptr, segment);
+    kcp->stats.retrans_timeout += lost;
+    kcp->stats.retrans_fast += change;
 
-            if (segment->len > 0) {
-                memcpy(ptr, segment->data, segment->len);
-                ptr += segment->len;
-            }
+    // let congestion control react
+    if (kcp->cc->on_loss) {
+        if (change) kcp->cc->on_loss(kcp, IKCP_LOSS_FAST, change);
+        if (lost) kcp->cc->on_loss(kcp, IKCP_LOSS_TIMEOUT, lost);
+    }
 
-            if (segment->xmit >= kcp->dead_link) {
-                kcp->state = -1;
-            }
-        }
+    if (kcp->cwnd < 1) {
+        kcp->cwnd = 1;
+        kcp->incr = kcp->mss;
     }
+}
 
-    // flash remain segments
-    size = (int)(ptr - buffer);
-    if (size > 0) {
-        ikcp_output(kcp, buffer, size);
+// immediate mode: send the segments that just became sendable, stamped
+// with the time of now rather than of the last ikcp_update
+static void ikcp_flush_fresh(ikcpcb *kcp)
+{
+    if (kcp->updated == 0) return;
+    if (iqueue_is_empty(&kcp->snd_queue) && (kcp->nsnd_buf == 0 ||
+        iqueue_entry(kcp->snd_buf.prev, IKCPSEG, node)->xmit != 0)) {
+        return;
     }
+    kcp->current = ikcp_now(kcp);
+    ikcp_stats_begin(kcp);
+    ikcp_flush_data(kcp, ikcp_dgram_begin(kcp), ikcp_wnd_unused(kcp), 1);
+    ikcp_stats_end(kcp);
+}
 
-    // update ssthresh
-    if (change) {
-        IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-        kcp->ssthresh = inflight / 2;
-        if (kcp->ssthresh < IKCP_THRESH_MIN)
-            kcp->ssthresh = IKCP_THRESH_MIN;
-        kcp->cwnd = kcp->ssthresh + resent;
-        kcp->incr = kcp->cwnd * kcp->mss;
+
+//---------------------------------------------------------------------
+// ikcp_flush
+//---------------------------------------------------------------------
+void ikcp_flush(ikcpcb *kcp)
+{
+    char *ptr;
+    int count, i, n;
+    IKCPSEG seg;
+
+    // 'ikcp_update' haven't been called.
+    if (kcp->updated == 0) return;
+
+    ikcp_stats_begin(kcp);
+    ptr = ikcp_dgram_begin(kcp);
+
+    seg.conv = kcp->conv;
+    seg.cmd = IKCP_CMD_ACK;
+    seg.frg = (kcp->sack? IKCP_FRG_SACK : 0) | (IUINT32)kcp->wscale;
+    seg.wnd = ikcp_wnd_unused(kcp);
+    seg.una = kcp->rcv_nxt;
+    seg.len = 0;
+    seg.sn = 0;
+    seg.ts = 0;
+
+    // flush acknowledges
+    count = kcp->ackcount;
+    if (count > 0 && kcp->sack && kcp->rmt_sack) {
+        ptr = ikcp_flush_sack(kcp, ptr, &seg);
+    }	else {
+        for (i = 0; i < count; i += n) {
+            ptr = ikcp_dgram_reserve(kcp, ptr, IKCP_OVERHEAD);
+            n = ((int)kcp->mtu - ikcp_dgram_size(kcp, ptr)) /
+                (int)IKCP_OVERHEAD;
+            if (n > count - i) n = count - i;
+            ptr = ikcp_encode_acks(ptr, &seg, kcp->acklist + i * 2, n);
+        }
     }
 
-    if (lost) {
-        kcp->ssthresh = cwnd / 2;
-        if (kcp->ssthresh < IKCP_THRESH_MIN)
-            kcp->ssthresh = IKCP_THRESH_MIN;
-        kcp->cwnd = 1;
-        kcp->incr = kcp->mss;
+    kcp->ackcount = 0;
+
+    // probe window size (if remote window size equals zero)
+    if (kcp->rmt_wnd == 0) {
+        if (kcp->probe_wait == 0) {
+            kcp->probe_wait = IKCP_PROBE_INIT * kcp->clock;
+            kcp->ts_probe = kcp->current + kcp->probe_wait;
+        }
+        else {
+            if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
+                if (kcp->probe_wait < IKCP_PROBE_INIT * kcp->clock)
+                    kcp->probe_wait = IKCP_PROBE_INIT * kcp->clock;
+                kcp->probe_wait += kcp->probe_wait / 2;
+                if (kcp->probe_wait > IKCP_PROBE_LIMIT * kcp->clock)
+                    kcp->probe_wait = IKCP_PROBE_LIMIT * kcp->clock;
+                kcp->ts_probe = kcp->current + kcp->probe_wait;
+                kcp->probe |= IKCP_ASK_SEND;
+            }
+        }
+    }	else {
+        kcp->ts_probe = 0;
+        kcp->probe_wait = 0;
     }
 
-    if (kcp->cwnd < 1) {
-        kcp->cwnd = 1;
-        kcp->incr = kcp->mss;
+    // flush window probing commands
+    if (kcp->probe & IKCP_ASK_SEND) {
+        kcp->stats.retrans_probe++;
+        seg.cmd = IKCP_CMD_WASK;
+        ptr = ikcp_dgram_reserve(kcp, ptr, IKCP_OVERHEAD);
+        ptr = ikcp_encode_seg(ptr, &seg);
+    }
+
+    // flush window probing commands
+    if (kcp->probe & IKCP_ASK_TELL) {
+        seg.cmd = IKCP_CMD_WINS;
+        ptr = ikcp_dgram_reserve(kcp, ptr, IKCP_OVERHEAD);
+        ptr = ikcp_encode_seg(ptr, &seg);
     }
+
+    kcp->probe = 0;
+
+    ikcp_flush_data(kcp, ptr, seg.wnd, 0);
+    ikcp_stats_end(kcp);
 }
 
 
 //---------------------------------------------------------------------
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
-// 'current' - current timestamp in millisec.
+// 'current' - current timestamp in millisec, or in ikcp_setclock ticks.
 //---------------------------------------------------------------------
 void ikcp_update(ikcpcb *kcp, IUINT32 current)
 {
-    IINT32 slap;
+    IINT32 slap, resync = (IINT32)(IKCP_RESYNC * kcp->clock);
 
     kcp->current = current;
 
@@ -1060,7 +3077,7 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 
     slap = _itimediff(kcp->current, kcp->ts_flush);
 
-    if (slap >= 10000 || slap < -10000) {
+    if (slap >= resync || slap < -resync) {
         kcp->ts_flush = kcp->current;
         slap = 0;
     }
@@ -1072,6 +3089,9 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
         }
         ikcp_flush(kcp);
     }
+    else if (kcp->pace_held && _itimediff(kcp->current, kcp->pace_next) >= 0) {
+        ikcp_flush(kcp);
+    }
 }
 
 
@@ -1089,15 +3109,16 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
     IUINT32 ts_flush = kcp->ts_flush;
     IINT32 tm_flush = 0x7fffffff;
     IINT32 tm_packet = 0x7fffffff;
+    IINT32 tm_pace = 0x7fffffff;
     IUINT32 minimal = 0;
-    struct IQUEUEHEAD *p;
+    IINT32 resync = (IINT32)(IKCP_RESYNC * kcp->clock);
 
     if (kcp->updated == 0) {
         return current;
     }
 
-    if (_itimediff(current, ts_flush) >= 10000 ||
-        _itimediff(current, ts_flush) < -10000) {
+    if (_itimediff(current, ts_flush) >= resync ||
+        _itimediff(current, ts_flush) < -resync) {
         ts_flush = current;
     }
 
@@ -1107,15 +3128,26 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
     tm_flush = _itimediff(ts_flush, current);
 
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-        const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-        IINT32 diff = _itimediff(seg->resendts, current);
-        if (diff <= 0) {
+    // due segments held by pacing go out at pace_next
+    if (kcp->pace_held) {
+        tm_pace = _itimediff(kcp->pace_next, current);
+        if (tm_pace <= 0) {
+            return current;
+        }
+    }
+
+    // the earliest retransmit, unless pacing holds it anyway
+    if (kcp->rto_count > 0) {
+        IINT32 diff = _itimediff(kcp->rto_heap[1]->resendts, current);
+        if (diff > 0) {
+            tm_packet = diff;
+        }
+        else if (kcp->pace_held == 0) {
             return current;
         }
-        if (diff < tm_packet) tm_packet = diff;
     }
 
+    if (tm_pace < tm_packet) tm_packet = tm_pace;
     minimal = (IUINT32)(tm_packet < tm_flush ? tm_packet : tm_flush);
     if (minimal >= kcp->interval) minimal = kcp->interval;
 
@@ -1127,23 +3159,68 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
     char *buffer;
+    struct IKCPIOV *iov;
     if (mtu < 50 || mtu < (int)IKCP_OVERHEAD)
         return -1;
-    buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+    if (kcp->batch != NULL && mtu > kcp->batch->mtu)
+        return -1;
+    buffer = ikcp_buffer_alloc(mtu, kcp->headroom, kcp->tailroom);
     if (buffer == NULL)
         return -2;
+    iov = ikcp_iov_alloc(mtu);
+    if (iov == NULL) {
+        ikcp_free(buffer - kcp->headroom);
+        return -2;
+    }
     kcp->mtu = mtu;
     kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-    ikcp_free(kcp->buffer);
+    kcp->stream_tail = NULL;
+    ikcp_buffer_free(kcp);
+    kcp->buffer = buffer;
+    ikcp_free(kcp->iov);
+    kcp->iov = iov;
+    return 0;
+}
+
+int ikcp_reserve(ikcpcb *kcp, int head, int tail)
+{
+    char *buffer;
+    if (head < 0 || tail < 0)
+        return -1;
+    buffer = ikcp_buffer_alloc(kcp->mtu, head, tail);
+    if (buffer == NULL)
+        return -2;
+    ikcp_buffer_free(kcp);
     kcp->buffer = buffer;
+    kcp->headroom = head;
+    kcp->tailroom = tail;
     return 0;
 }
 
+static IUINT32 ikcp_interval_bound(const ikcpcb *kcp, int interval)
+{
+    if (interval < (int)IKCP_INTERVAL_MIN) return IKCP_INTERVAL_MIN;
+    return _imin_((IUINT32)interval, IKCP_INTERVAL_MAX * kcp->clock);
+}
+
 int ikcp_interval(ikcpcb *kcp, int interval)
 {
-    if (interval > 5000) interval = 5000;
-    else if (interval < 10) interval = 10;
-    kcp->interval = interval;
+    kcp->interval = ikcp_interval_bound(kcp, interval);
+    return 0;
+}
+
+int ikcp_setclock(ikcpcb *kcp, IUINT32 clock)
+{
+    if (clock != IKCP_CLOCK_MS && clock != IKCP_CLOCK_US)
+        return -1;
+    if (kcp->updated)
+        return -2;
+    // what kcp set up itself keeps its length in time
+    kcp->rx_rto = kcp->rx_rto / kcp->clock * clock;
+    kcp->rx_minrto = kcp->rx_minrto / kcp->clock * clock;
+    kcp->interval = kcp->interval / kcp->clock * clock;
+    kcp->ts_flush = kcp->interval;
+    kcp->clock = clock;
     return 0;
 }
 
@@ -1152,16 +3229,14 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
     if (nodelay >= 0) {
         kcp->nodelay = nodelay;
         if (nodelay) {
-            kcp->rx_minrto = IKCP_RTO_NDL;
+            kcp->rx_minrto = IKCP_RTO_NDL * kcp->clock;
         }
         else {
-            kcp->rx_minrto = IKCP_RTO_MIN;
+            kcp->rx_minrto = IKCP_RTO_MIN * kcp->clock;
         }
     }
     if (interval >= 0) {
-        if (interval > 5000) interval = 5000;
-        else if (interval < 10) interval = 10;
-        kcp->interval = interval;
+        kcp->interval = ikcp_interval_bound(kcp, interval);
     }
     if (resend >= 0) {
         kcp->fastresend = resend;
@@ -1177,15 +3252,102 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 {
     if (kcp) {
         if (sndwnd > 0) {
+            if (ikcp_ring_resize(kcp, sndwnd) != 0)
+                return -2;
             kcp->snd_wnd = sndwnd;
         }
         if (rcvwnd > 0) {
+            if (ikcp_slot_resize(kcp, rcvwnd) != 0)
+                return -2;
             kcp->rcv_wnd = rcvwnd;
+            // smallest shift bringing the window into the 16 bit wnd
+            kcp->wscale = 0;
+            while ((kcp->rcv_wnd >> kcp->wscale) > 0xffff &&
+                kcp->wscale < (int)IKCP_WSCALE_MAX) {
+                kcp->wscale++;
+            }
         }
     }
     return 0;
 }
 
+int ikcp_setstream(ikcpcb *kcp, int enable)
+{
+    kcp->stream = enable? 1 : 0;
+    kcp->stream_tail = NULL;
+    return 0;
+}
+
+int ikcp_setlarge(ikcpcb *kcp, int enable)
+{
+    kcp->large = enable? 1 : 0;
+    return 0;
+}
+
+int ikcp_setmemlimit(ikcpcb *kcp, IUINT64 limit)
+{
+    kcp->mem_limit = limit;
+    return 0;
+}
+
+int ikcp_setsack(ikcpcb *kcp, int enable)
+{
+    kcp->sack = enable? 1 : 0;
+    if (kcp->sack == 0) kcp->rmt_sack = 0;
+    return 0;
+}
+
+int ikcp_setcc(ikcpcb *kcp, const ikcpcc *cc)
+{
+    const ikcpcc *old = kcp->cc;
+    void *state = kcp->cc_state;
+    void *newstate;
+
+    if (cc == NULL) cc = &ikcp_cc_reno;
+    if (cc == old) return 0;
+
+    kcp->cc_state = NULL;
+    if (cc->init != NULL && cc->init(kcp) < 0) {
+        kcp->cc_state = state;
+        return -1;
+    }
+
+    newstate = kcp->cc_state;
+    kcp->cc_state = state;
+    if (old->release) {
+        old->release(kcp);
+    }
+
+    kcp->cc = cc;
+    kcp->cc_state = newstate;
+    return 0;
+}
+
+IUINT32 ikcp_pacing_rate(const ikcpcb *kcp)
+{
+    if (kcp->cc->pacing_rate == NULL) return 0;
+    return kcp->cc->pacing_rate(kcp);
+}
+
+int ikcp_setpacing(ikcpcb *kcp, int enable, IUINT32 rate)
+{
+    kcp->pacing = enable? 1 : 0;
+    kcp->pace_conf = rate;
+    kcp->pace_held = 0;
+    kcp->pace_last = kcp->current - kcp->interval;
+    kcp->pace_tokens = 0;
+    return 0;
+}
+
+int ikcp_setimmediate(ikcpcb *kcp, int enable,
+    IUINT32 (*now)(ikcpcb *kcp, void *user))
+{
+    if (enable && now == NULL) return -1;
+    kcp->immediate = enable? 1 : 0;
+    kcp->now = now;
+    return 0;
+}
+
 int ikcp_waitsnd(const ikcpcb *kcp)
 {
     return kcp->nsnd_buf + kcp->nsnd_que;
@@ -253,6 +253,14 @@ typedef struct IQUEUEHEAD iqueue_head;
 //=====================================================================
 // SEGMENT
 //=====================================================================
+struct IKCPREF;
+
+struct IKCPIOV
+{
+    const char *base;
+    int len;
+};
+
 struct IKCPSEG
 {
     struct IQUEUEHEAD node;
@@ -265,12 +273,115 @@ struct IKCPSEG
     IUINT32 una;
     IUINT32 len;
     IUINT32 resendts;
+    IUINT32 heap;               // index in kcp->rto_heap, 0 if not in it
+    IUINT32 fast;               // index in kcp->rto_fast, 0 if not in it
     IUINT32 rto;
     IUINT32 fastack;
     IUINT32 xmit;
-    char data[1];
+    IUINT32 delivered;          // kcp->delivered when last sent
+    IUINT32 delivered_ts;       // kcp->delivered_ts when last sent
+    IUINT32 queued;             // clock when ikcp_send queued it
+    struct IKCPREF *ref;        // owner of 'data' when it is not 'buf'
+    char *data;
+    char buf[1];
+};
+
+
+//---------------------------------------------------------------------
+// SEGMENT POOL
+//---------------------------------------------------------------------
+#define IKCP_POOL_CLASSES 8
+
+struct IKCPBLOCK;
+
+struct IKCPPOOLCLASS
+{
+    IUINT32 size;               // payload capacity of the class
+    IUINT32 block;              // bytes per block (header + seg + payload)
+    struct IKCPBLOCK *freelist;
+    IUINT32 nfree, nused, peak, nslab;
+};
+
+struct IKCPPOOL
+{
+    struct IKCPPOOLCLASS classes[IKCP_POOL_CLASSES];
+    int nclass;
+    IUINT32 mss, slab_count;
+    IUINT32 nheap, heap_peak;   // oversized segments served by ikcp_malloc
+    void *slabs;
+};
+
+typedef struct IKCPPOOL ikcppool;
+
+
+//---------------------------------------------------------------------
+// DATAGRAM BATCH: flush output collected for one sendmmsg
+//---------------------------------------------------------------------
+struct IKCPDGRAM
+{
+    char *data;
+    int len;
+    struct IKCPCB *kcp;         // producer of the datagram
+    void *user;                 // kcp->user at the time it was produced
+};
+
+struct IKCPBATCH
+{
+    struct IKCPDGRAM *dgrams;
+    int count, capacity;
+    int mtu;                    // bytes per slot, largest kcp mtu allowed
+    int headroom, tailroom;     // spare bytes around each slot
+    char *storage;
+    void *user;
+    int (*output)(struct IKCPBATCH *batch, void *user);
+};
+
+typedef struct IKCPBATCH ikcpbatch;
+
+
+//---------------------------------------------------------------------
+// RATE SAMPLE: what one ikcp_input acknowledged
+//---------------------------------------------------------------------
+struct IKCPRATE
+{
+    IUINT32 una;                // snd_una before the input
+    IUINT32 acked;              // segments acked by the input
+    IUINT32 delivered;          // kcp->delivered when the newest acked
+                                // segment sent only once was sent
+    IINT32 interval;            // ms it took to deliver the segments
+                                // counted since then, -1 if every acked
+                                // segment was retransmitted
+    IINT32 rtt;                 // last rtt sample, -1 if none
+};
+
+typedef struct IKCPRATE ikcprate;
+
+
+//---------------------------------------------------------------------
+// STATISTICS: counters kept as kcp sends and receives, read them with
+// ikcp_stats. histogram bucket 0 counts samples of 0 ticks, bucket
+// i samples from 2^(i-1) to 2^i - 1 ticks, the last one all above.
+//---------------------------------------------------------------------
+#define IKCP_STATS_BUCKETS 24
+
+struct IKCPSTATS
+{
+    IUINT64 out_pkts, out_bytes;    // datagrams sent
+    IUINT64 in_pkts, in_bytes;      // datagrams given to ikcp_input
+    IUINT64 segs_sent;              // data segments sent the first time
+    IUINT64 segs_recv;              // new data segments taken
+    IUINT32 retrans_timeout;        // data segments resent after rto
+    IUINT32 retrans_fast;           // resent after fastresend acks
+    IUINT32 retrans_probe;          // window probes sent to a zero window
+    IUINT32 segs_dup;               // data segments received already
+    IUINT32 segs_refused;           // beyond rcv_wnd or over mem_limit
+    IUINT32 input_errors;           // ikcp_input calls below zero
+    IUINT32 rtt_hist[IKCP_STATS_BUCKETS];       // rtt samples
+    IUINT32 latency_hist[IKCP_STATS_BUCKETS];   // ikcp_send to ack
 };
 
+typedef struct IKCPSTATS ikcpstats;
+
 
 //---------------------------------------------------------------------
 // IKCPCB
@@ -283,6 +394,7 @@ struct IKCPCB
     IINT32 rx_rttval, rx_srtt, rx_rto, rx_minrto;
     IUINT32 snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
     IUINT32 current, interval, ts_flush, xmit;
+    IUINT32 clock;              // clock ticks per millisec
     IUINT32 nrcv_buf, nsnd_buf;
     IUINT32 nrcv_que, nsnd_que;
     IUINT32 nodelay, updated;
@@ -291,22 +403,99 @@ struct IKCPCB
     struct IQUEUEHEAD snd_queue;
     struct IQUEUEHEAD rcv_queue;
     struct IQUEUEHEAD snd_buf;
-    struct IQUEUEHEAD rcv_buf;
+    struct IKCPSEG **snd_ring;
+    IUINT32 snd_ring_mask;
+    struct IKCPSEG **rto_heap;      // sent segments, min-heap on resendts
+    struct IKCPSEG **rto_fast;      // sent segments due for fast resend
+    IUINT32 rto_count, rto_nfast;
+    struct IKCPSEG **rcv_slots;
+    IUINT32 *rcv_bitmap;
+    IUINT32 rcv_slot_mask;
+    struct IKCPPOOL *pool;
+    struct IKCPBATCH *batch;
+    char *dgram;
+    struct IKCPIOV *iov;
+    int niov, iovlen;
+    char *iovhead;
     IUINT32 *acklist;
     IUINT32 ackcount;
     IUINT32 ackblock;
     void *user;
     char *buffer;
+    int headroom, tailroom;     // spare bytes around kcp->buffer
     int fastresend;
     int nocwnd;
+    int sack, rmt_sack;
+    int wscale, rmt_wscale;     // shift of our / the remote's window
+    int stream, large;
+    int immediate;
+    IUINT64 mem_used, mem_limit;    // bytes of segments and rings
+    struct IKCPSEG *stream_tail;    // snd_queue tail with mss capacity
+    IUINT32 delivered, delivered_ts;
+    struct IKCPRATE rs;
+    const struct IKCPCC *cc;
+    void *cc_state;
+    int pacing, pace_held;
+    IUINT32 pace_conf, pace_rate, pace_last, pace_next;
+    IINT64 pace_tokens;
+    struct IKCPSTATS stats;
+    volatile IUINT32 stats_seq;     // odd while stats are being written
     int logmask;
     int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
+    int (*outputv)(const struct IKCPIOV *iov, int count, struct IKCPCB *kcp, void *user);
     void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+    IUINT32 (*now)(struct IKCPCB *kcp, void *user);
 };
 
 
 typedef struct IKCPCB ikcpcb;
 
+//---------------------------------------------------------------------
+// CONGESTION CONTROL: callbacks owning kcp->cwnd, kcp->cc_state is
+// private to them. any callback but on_ack may be NULL.
+//---------------------------------------------------------------------
+#define IKCP_LOSS_FAST			1	// fast retransmit
+#define IKCP_LOSS_TIMEOUT		2	// retransmit timeout
+
+struct IKCPCC
+{
+    const char *name;
+    int (*init)(ikcpcb *kcp);
+    void (*release)(ikcpcb *kcp);
+    // once per ikcp_input which acked anything
+    void (*on_ack)(ikcpcb *kcp, const struct IKCPRATE *rs);
+    // once per ikcp_flush and reason, 'count' segments resent
+    void (*on_loss)(ikcpcb *kcp, int reason, IUINT32 count);
+    // each time a data segment is put on the wire
+    void (*on_send)(ikcpcb *kcp, const struct IKCPSEG *seg);
+    // bytes per second the sender should not exceed, 0 for unpaced
+    IUINT32 (*pacing_rate)(const ikcpcb *kcp);
+};
+
+typedef struct IKCPCC ikcpcc;
+
+// slow start / AIMD with ssthresh halving and cwnd=1 on timeout (default)
+extern const ikcpcc ikcp_cc_reno;
+
+// delivery rate based: cwnd follows twice the measured bandwidth delay
+// product, losses alone do not shrink it
+extern const ikcpcc ikcp_cc_bbr;
+
+//---------------------------------------------------------------------
+// MESSAGE: segments of one received message, lent to the caller
+//---------------------------------------------------------------------
+struct IKCPMSG
+{
+    struct IQUEUEHEAD segs;
+    int size;
+    int count;
+};
+
+typedef struct IKCPMSG ikcpmsg;
+
+#define IKCP_CLOCK_MS			1		// ticks per millisec of the
+#define IKCP_CLOCK_US			1000	// timestamps passed to kcp
+
 #define IKCP_LOG_OUTPUT			1
 #define IKCP_LOG_INPUT			2
 #define IKCP_LOG_SEND			4
@@ -319,6 +508,8 @@ typedef struct IKCPCB ikcpcb;
 #define IKCP_LOG_OUT_ACK		512
 #define IKCP_LOG_OUT_PROBE		1024
 #define IKCP_LOG_OUT_WINS		2048
+#define IKCP_LOG_IN_SACK		4096
+#define IKCP_LOG_OUT_SACK		8192
 
 #ifdef __cplusplus
 extern "C" {
@@ -331,6 +522,8 @@ extern "C" {
 // create a new kcp control object, 'conv' must equal in two endpoint
 // from the same connection. 'user' will be passed to the output callback
 // output callback can be setup like this: 'kcp->output = my_udp_output'
+// when 'kcp->outputv' is set instead, each datagram is handed over as a
+// scatter/gather list of header and payload slices without copying.
 // conv: ͬһӵ token
 // user: ݵõĻص
 //  kcp ƶͬһcnov շ˱һ£շݲɹ
@@ -341,13 +534,47 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user);
 void ikcp_release(ikcpcb *kcp);
 
 // user/upper level recv: returns size, returns below zero for EAGAIN
+// in stream mode it reads up to 'len' bytes across segment boundaries.
 //  kcp нնԶ˵ķ
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
-// user/upper level send, returns below zero for error
+// user/upper level recv without copying: detaches the segments of the
+// next message into 'msg' and returns its size, -1 when the queue is
+// empty, -2 when the message is incomplete. the payload stays valid
+// until ikcp_msg_release, which may outlive ikcp_release but not the
+// pool the segments came from (see ikcp_msg_release).
+int ikcp_recvmsg(ikcpcb *kcp, ikcpmsg *msg);
+
+// user/upper level recv of part of the next message: copies up to 'len'
+// bytes of it, the rest stays queued for the next call. '*last' is set
+// to 1 when the bytes returned end the message. returns below zero for
+// EAGAIN. this is how messages larger than rcv_wnd must be read.
+int ikcp_recvpart(ikcpcb *kcp, char *buffer, int len, int *last);
+
+// fill at most 'count' (pointer, length) views over 'msg' payload,
+// returns the number of views the message has (msg->count).
+int ikcp_msg_views(const ikcpmsg *msg, struct IKCPIOV *iov, int count);
+
+// return the segments of 'msg' to their allocator. segments from a pool
+// (ikcp_setpool, ikcp_setpool_thread) go back to it: the pool must not be
+// released yet, and the call must be made on the thread owning the pool,
+// as pools are not thread-safe. segments of kcp without a pool are heap
+// allocated and may be released anywhere.
+void ikcp_msg_release(ikcpmsg *msg);
+
+// user/upper level send, returns below zero for error, -3 if over
+// kcp->mem_limit
 //  ݵ kcp kcp user  ص ݷ
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// user/upper level send without copying: fragments point into the 'iov'
+// slices, which must stay valid until 'release(user)' is called once the
+// whole message is acknowledged or kcp is released. returns below zero
+// for error. 'release' is called at once when nothing references the
+// slices: for an empty message, and on every error.
+int ikcp_sendv(ikcpcb *kcp, const struct IKCPIOV *iov, int count,
+    void (*release)(void *user), void *user);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec.
@@ -374,6 +601,10 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current);
 // յײ UDP ͨú KCP
 int ikcp_input(ikcpcb *kcp, const char *data, long size);
 
+// read conv from a raw packet, to find the kcp object it belongs to.
+// 'ptr' must hold at least the 24 byte segment header.
+IUINT32 ikcp_getconv(const void *ptr);
+
 // flush pending data
 // ˢ´ݣú  ikcp_update ڲ
 void ikcp_flush(ikcpcb *kcp);
@@ -385,7 +616,29 @@ int ikcp_peeksize(const ikcpcb *kcp);
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
-// set maximum window size: sndwnd=32, rcvwnd=32 by default
+// keep 'head' bytes before and 'tail' bytes after every datagram handed
+// to kcp->output writable, so an outer layer can add its header and
+// trailer in place: 'buf - head' to 'buf + len + tail' is free to use
+// during the call. the mtu still only counts the kcp part. outputv
+// slices are not covered, and ikcp_batch_reserve does it for batches.
+int ikcp_reserve(ikcpcb *kcp, int head, int tail);
+
+// clock resolution: IKCP_CLOCK_MS (default) or IKCP_CLOCK_US, only
+// before the first ikcp_update. every time kcp takes or returns, from
+// ikcp_update/ikcp_check to the interval and kcp->rx_minrto, is then
+// in ticks of that clock, and rto, rtt and pacing get microsecond
+// precision. the interval may go down to 10 ticks, set kcp->rx_minrto
+// after ikcp_nodelay for a sub-millisec floor. the two ends may use
+// different clocks, timestamps on the wire stay 32 bit and are only
+// echoed back to the end which made them: in microseconds they wrap
+// every 71 minutes, which only differences ever see.
+int ikcp_setclock(ikcpcb *kcp, IUINT32 clock);
+
+// set maximum window size: sndwnd=32, rcvwnd=32 by default. a rcvwnd
+// above 65535 is advertised in units of 1 << kcp->wscale segments, the
+// shift going out in the frg of acks and window probes, where the remote
+// picks it up to scale the wnd of every header that follows. returns -2
+// if out of memory or over kcp->mem_limit.
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 
 // get how many packet is waiting to be sent
@@ -403,6 +656,63 @@ int ikcp_waitsnd(const ikcpcb *kcp);
 //  ΪǷóأֹ
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc);
 
+// stream mode: 0:disable(default), 1:enable. ikcp_send appends to the
+// last queued segment until it holds mss bytes and message boundaries
+// are dropped: ikcp_recv reads the data as a byte stream, ikcp_peeksize
+// tells how many bytes are ready.
+int ikcp_setstream(ikcpcb *kcp, int enable);
+
+// large messages: 0:disable(default), 1:enable. lifts the limit of 255
+// fragments per message: frg counts down the fragments left, saturating
+// at 255, and only 0 marks the last one. it only changes what ikcp_send
+// and ikcp_sendv accept: any receiver of this version takes such
+// messages, messages of up to 255 fragments are unchanged.
+int ikcp_setlarge(ikcpcb *kcp, int enable);
+
+// selective ack: 0:disable(default), 1:enable. once both ends enable it,
+// acks are sent as one IKCP_CMD_SACK per flush carrying a bitmap of the
+// segments received after una instead of one segment per packet
+int ikcp_setsack(ikcpcb *kcp, int enable);
+
+// switch congestion control (NULL for ikcp_cc_reno), cwnd carries over
+// unless the new controller sets it up. returns below zero if its init
+// fails, in which case the old controller is kept.
+int ikcp_setcc(ikcpcb *kcp, const ikcpcc *cc);
+
+// pacing rate of the congestion control in bytes per second, 0 if none
+IUINT32 ikcp_pacing_rate(const ikcpcb *kcp);
+
+// pacing: 0:disable(default), 1:spread data segments over time instead
+// of sending the whole window at once. rate: bytes per second, 0 to
+// follow ikcp_pacing_rate, or cwnd/srtt when congestion control has none.
+// held segments go out on a later ikcp_update, call it at ikcp_check
+// time to pace finer than the interval.
+int ikcp_setpacing(ikcpcb *kcp, int enable, IUINT32 rate);
+
+// immediate mode: 0:disable(default), 1:enable. segments queued by
+// ikcp_send and window freed by acks in ikcp_input go out at once in a
+// flush of just the unsent segments, acks and window probes still wait
+// for ikcp_update. with a batch, the datagrams wait for its flush.
+// 'now' returns the clock ikcp_update is called with, for the send
+// times of those segments, and is required to enable it. it may be
+// given with enable 0 too: ikcp_send and ikcp_input then read it for
+// the queueing latency of ikcp_stats.
+int ikcp_setimmediate(ikcpcb *kcp, int enable,
+    IUINT32 (*now)(ikcpcb *kcp, void *user));
+
+// memory limit in bytes, 0 for none (default). segments of both
+// directions and the window rings count against it (kcp->mem_used):
+// ikcp_send/ikcp_sendv return -3 rather than go over, the advertised
+// window shrinks to what still fits, and data segments which do not fit
+// are dropped unacked, except the one at rcv_nxt. segments handed out
+// by ikcp_recvmsg no longer count.
+int ikcp_setmemlimit(ikcpcb *kcp, IUINT64 limit);
+
+// copy a consistent snapshot of kcp->stats, safe to call from another
+// thread than the one driving kcp, which updates the counters under
+// kcp->stats_seq: a sequence lock the copy retries on until it holds.
+void ikcp_stats(const ikcpcb *kcp, ikcpstats *stats);
+
 // շbuf  --- δʵ
 int ikcp_rcvbuf_count(const ikcpcb *kcp);
 int ikcp_sndbuf_count(const ikcpcb *kcp);
@@ -414,6 +724,46 @@ void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 // setup allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 
+// create a segment pool: size classes up to the mss of 'mtu', each slab
+// holds 'slab_count' blocks (0 for default). a pool is not thread-safe,
+// share it only between kcp objects driven by the same thread.
+ikcppool* ikcp_pool_create(int mtu, int slab_count);
+
+// release a pool and all its slabs, no segment may still be in use
+void ikcp_pool_release(ikcppool *pool);
+
+// attach a pool to kcp (NULL to detach), segments allocated before keep
+// returning to the pool they came from
+void ikcp_setpool(ikcpcb *kcp, ikcppool *pool);
+
+// set the pool used by kcp objects of the calling thread which have no
+// pool of their own (NULL to disable)
+void ikcp_setpool_thread(ikcppool *pool);
+
+// create a batch of 'capacity' datagram slots of 'mtu' bytes. 'output' is
+// called with all collected datagrams when the batch fills up and from
+// ikcp_batch_flush, the batch is empty again once it returns.
+ikcpbatch* ikcp_batch_create(int capacity, int mtu,
+    int (*output)(ikcpbatch *batch, void *user), void *user);
+
+// release a batch, pending datagrams are dropped
+void ikcp_batch_release(ikcpbatch *batch);
+
+// keep 'head' bytes before and 'tail' bytes after each slot writable,
+// as ikcp_reserve does for kcp->buffer. returns -1 if datagrams are
+// pending, -2 if out of memory, in which case the slots are unchanged.
+int ikcp_batch_reserve(ikcpbatch *batch, int head, int tail);
+
+// hand pending datagrams to batch->output, call it after updating all
+// the kcp objects sharing the batch. returns what output returns.
+int ikcp_batch_flush(ikcpbatch *batch);
+
+// make ikcp_flush write datagrams into 'batch' instead of calling
+// output/outputv (NULL to detach). several kcp objects driven by the same
+// loop may share one batch, flush it before releasing any of them.
+// returns -1 if kcp mtu exceeds the slot size.
+int ikcp_setbatch(ikcpcb *kcp, ikcpbatch *batch);
+
 
 #ifdef __cplusplus
 }
@@ -9,6 +9,8 @@
 #include <pthread.h>
 #include <sys/wait.h>
 #include <stdint.h>
+#include <map>
+#include <set>
 
 #include "kcpclient.h"
 #include "LibLog.h"
@@ -16,6 +18,16 @@
 
 static int gRun = 1;
 UdpSocket sock;
+KcpFecEncoder* gFecEnc = NULL;
+KcpFecDecoder* gFecDec = NULL;
+KcpAead* gAead = NULL;
+KcpCompressor* gLz4 = NULL;
+
+// compressed datagram, with room for the encryption header and tag around it
+static char gPacket[KcpAead::HEADER_SIZE + 1400 + KcpAead::TAG_SIZE];
+
+// ms a partly filled fec group waits for more datagrams before its parity
+static const uint64_t FEC_FLUSH_WAIT = 20;
 
     
 /*F InitLogInfo()
@@ -50,14 +62,235 @@ void InitSignalProcess()
 }
 
 
+int fec_output(const char *buf, int len, void *user)
+{
+	SocketAddress *pto = (SocketAddress *)user;
+	return sock.Send(buf, len, *pto);
+}
+
 int udp_output(const char *buf, int len, ikcpcb *kcp, void *user)
 {
 	SocketAddress *pto = (SocketAddress *)user;
-	int ret = sock.Send(buf, len, *pto);
 	AppLog(LOG_BASE, "udp_output send len %d\n", len);
+	if (gLz4 != NULL)
+	{
+		len = gLz4->Compress(buf, len, gPacket + KcpAead::HEADER_SIZE);
+		buf = gPacket + KcpAead::HEADER_SIZE;
+	}
+	if (gAead != NULL)
+	{
+		// buf is kcp->buffer, where ikcp_reserve left room for the header
+		// and tag, or gPacket after compression, which has the same room
+		len = gAead->Seal((char *)buf, len);
+		buf -= KcpAead::HEADER_SIZE;
+	}
+	return (gFecEnc != NULL) ? gFecEnc->Encode(buf, len, fec_output, user) : sock.Send(buf, len, *pto);
+}
+
+int udp_outputv(const struct IKCPIOV *iov, int count, ikcpcb *kcp, void *user)
+{
+	SocketAddress *pto = (SocketAddress *)user;
+	struct iovec vec[128];
+	if (count > 128)
+	{
+		return -1;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		vec[i].iov_base = (void *)iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	int ret = sock.SendV(vec, count, *pto);
+	AppLog(LOG_BASE, "udp_outputv send len %d\n", ret);
 	return ret;
 }
 
+typedef std::map<IUINT32, KcpTimerWheel::Handle*> KcpSessionMap;
+
+// what udp_input needs to hand a datagram to its kcp
+struct DrainContext
+{
+	KcpSessionMap* sessions;
+	KcpTimerWheel* wheel;
+	std::set<KcpTimerWheel::Handle*>* touched;
+	SocketAddress* to;
+	const SocketAddress* from;
+};
+
+// hand one kcp datagram, received or rebuilt by fec, to the kcp of its conv
+int udp_input(const char* data, int size, void* user)
+{
+	DrainContext* ctx = (DrainContext*)user;
+
+	if (size < 24)      // shorter than one kcp segment header
+	{
+		return -1;
+	}
+
+	KcpSessionMap::iterator it = ctx->sessions->find(ikcp_getconv(data));
+	if (it == ctx->sessions->end())
+	{
+		AppLog(LOG_BASE, "--- unknown conv %u from:%s\n", ikcp_getconv(data), ctx->from->ToString().data());
+		return -1;
+	}
+
+	if (*ctx->from != *ctx->to)
+	{
+		*ctx->to = *ctx->from;
+		AppLog(LOG_BASE, "chang dst addr to %s\n", ctx->to->ToString().data());
+	}
+
+	ctx->wheel->Input(*it->second, data, size);
+	ctx->touched->insert(it->second);
+	return 0;
+}
+
+// decompress one packet, then udp_input
+int lz4_input(const char* data, int size, void* user)
+{
+	const char* datagram = NULL;
+
+	if ((size = gLz4->Decompress(data, size, &datagram)) < 0)
+	{
+		AppLog(LOG_BASE, "--- bad compressed packet\n");
+		return -1;
+	}
+
+	return udp_input(datagram, size, user);
+}
+
+// decrypt one packet, then lz4_input or udp_input
+int aead_input(const char* data, int size, void* user)
+{
+	char plain[2048];
+
+	if ((size > (int)sizeof(plain)) || ((size = gAead->Open(data, size, plain)) < 0))
+	{
+		AppLog(LOG_BASE, "--- packet rejected, rejected:%u\n", gAead->GetRejected());
+		return -1;
+	}
+
+	return (gLz4 != NULL) ? lz4_input(plain, size, user) : udp_input(plain, size, user);
+}
+
+// read every pending datagram in batches, hand each one to the kcp of its
+// conv, then flush each kcp that got input once for the whole batch
+int udp_drain(DatagramRing& ring, KcpSessionMap& sessions, KcpTimerWheel& wheel, SocketAddress& to, int& index)
+{
+	std::set<KcpTimerWheel::Handle*> touched;
+	DrainContext ctx = { &sessions, &wheel, &touched, &to, NULL };
+	int total = 0;
+
+	// the ring may have been filled with more waiting, read again without
+	// blocking until a partial batch shows the socket is empty
+	while (ring.Recv(sock) > 0)
+	{
+		for (int n = 0; n < ring.Count(); n++)
+		{
+			const char* data = ring.Data(n);
+			int size = ring.Size(n);
+
+			// simulate packet loss
+			if ((++index)%4 == 0)
+			{
+				AppLog(LOG_BASE, "*** lost packet:%d  len:%d\n", index, size);
+				continue;
+			}
+
+			ctx.from = &ring.From(n);
+			KcpFecOutput input = (gAead != NULL) ? aead_input : ((gLz4 != NULL) ? lz4_input : udp_input);
+			if (gFecDec != NULL)
+			{
+				// passes the datagram on, plus any it completes the parity of
+				if (gFecDec->Decode(data, size, input, &ctx) < 0)
+				{
+					AppLog(LOG_BASE, "--- not a fec packet, len:%d from:%s\n", size, ctx.from->ToString().data());
+				}
+			}
+			else
+			{
+				input(data, size, &ctx);
+			}
+		}
+
+		total += ring.Count();
+		if ((ring.Count() < ring.Capacity()) || !sock.WaitInput(0))
+		{
+			break;
+		}
+	}
+
+	for (std::set<KcpTimerWheel::Handle*>::iterator it = touched.begin(); it != touched.end(); ++it)
+	{
+		ikcp_flush((*it)->kcp);
+		wheel.Rearm(**it);
+	}
+
+	AppLog(LOG_BASE, "--- udp_drain datagrams:%d  sessions:%d\n", total, (int)touched.size());
+	if (gFecDec != NULL)
+	{
+		AppLog(LOG_BASE, "--- fec recovered:%u  unrecovered:%u  parity:%u\n",
+			gFecDec->GetRecovered(), gFecDec->GetUnrecovered(), gFecDec->GetParity());
+	}
+	if (gLz4 != NULL)
+	{
+		AppLog(LOG_BASE, "--- lz4 in:%llu  out:%llu  bypassed:%u\n",
+			(unsigned long long)gLz4->GetBytesIn(), (unsigned long long)gLz4->GetBytesOut(), gLz4->GetBypassed());
+	}
+	return total;
+}
+
+// echo every message back on the session it came from
+class EchoHandler : public KcpEngine::Handler
+{
+public:
+	EchoHandler(): engine(NULL) {}
+
+	virtual bool OnAccept(KcpEngine::Session& session)
+	{
+		ikcp_nodelay(session.kcp, 1, 10, 2, 1);
+		AppLog(LOG_BASE, "+++ session conv:%u  worker:%d  from:%s\n", session.kcp->conv, session.worker, session.peer.ToString().data());
+		return true;
+	}
+
+	virtual void OnMessage(KcpEngine::Session& session, const char* data, int size)
+	{
+		engine->Send(session, data, size);
+	}
+
+	virtual void OnClose(KcpEngine::Session& session)
+	{
+		AppLog(LOG_BASE, "--- session conv:%u closed\n", session.kcp->conv);
+	}
+
+	KcpEngine* engine;
+};
+
+// serve kcp sessions on all workers until a signal
+int Serve(int localport, int workers)
+{
+	EchoHandler handler;
+	KcpEngine engine(&handler, workers);
+	handler.engine = &engine;
+
+	if (engine.Start(localport) < 0)
+	{
+		AppLog(LOG_BASE, "--- engine failed to start on port %d\n", localport);
+		return 1;
+	}
+	AppLog(LOG_BASE, "kcp engine on port %d  workers:%d  routing:%s\n", (int)engine.GetPort(), engine.GetWorkers(),
+		(KcpEngine::ROUTE_CONV == engine.GetRouting()) ? "conv" : "peer");
+
+	while (gRun)
+	{
+		sleep(1);
+	}
+
+	engine.Stop();
+	AppLog(LOG_BASE, "kcpclient over\n");
+	return 0;
+}
+
 int main(int argc,char *argv[])
 {
     InitLogInfo();
@@ -67,9 +300,16 @@ int main(int argc,char *argv[])
     SetAppLogLogGroup(false);
     AppLog(LOG_BASE, "kcpclient start\n");
 
-    if (argc != 4)
+    if ((argc >= 3) && (strcmp(argv[1], "serve") == 0))
+    {
+        int workers = (argc > 3) ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return Serve(atoi(argv[2]), (workers > KcpEngine::MAX_WORKERS) ? KcpEngine::MAX_WORKERS : workers);
+    }
+
+    if ((argc < 4) || (argc > 7))
     {
-        AppLog(LOG_BASE, "param err, please input: ./kcpclient localport desIp:port sendTimes\n");
+        AppLog(LOG_BASE, "param err, please input: ./kcpclient localport desIp:port sendTimes [dataShards:parityShards] [lz4] [key]\n");
+        AppLog(LOG_BASE, "   or: ./kcpclient serve localport [workers]\n");
         return 0;
     }
 
@@ -79,76 +319,134 @@ int main(int argc,char *argv[])
     
     SocketAddress to;
     to.SetIpAndPort(argv[2]);
-    SocketAddress from;
+
+    // optional fec, compression and encryption, both ends need the same options
+    for (int i = 4; i < argc; i++)
+    {
+        int dataShards = 0;
+        int parityShards = 0;
+        if (strcmp(argv[i], "lz4") == 0)
+        {
+            if (gLz4 == NULL)
+            {
+                // what the messages below are made of
+                static const char dict[] = "0123456789 hello world-";
+                gLz4 = new KcpCompressor(1400, dict, sizeof(dict) - 1);
+            }
+        }
+        else if (sscanf(argv[i], "%d:%d", &dataShards, &parityShards) == 2)
+        {
+            if ((gFecEnc == NULL) && (dataShards > 0))
+            {
+                gFecEnc = new KcpFecEncoder(dataShards, parityShards, 1400);
+                gFecDec = new KcpFecDecoder(dataShards, parityShards, 1400);
+            }
+        }
+        else if (gAead == NULL)
+        {
+            // test key: the text zero padded. the ends tell their nonces apart by port,
+            // so equal ports would give both the same side
+            if (localport == (int)to.GetPort())
+            {
+                AppLog(LOG_BASE, "--- both ends on port %d, encryption needs different ports\n", localport);
+                return 0;
+            }
+            unsigned char key[KcpAead::KEY_SIZE];
+            memset(key, 0, sizeof(key));
+            strncpy((char *)key, argv[i], sizeof(key));
+            gAead = new KcpAead(key, 0x01, (localport > (int)to.GetPort()) ? 1 : 0);
+        }
+    }
         
     char body[128];
     int  dataLen = sprintf(body, "%d hello world-0", localport); 
-    char buf[128];
-    int recvflag, recvDataLen;
+    DatagramRing ring;
+    KcpSessionMap sessions;
+    int recvDataLen;
+    ikcpmsg msg;
+    struct IKCPIOV view;
     int sendTimes = (int)atoi(argv[3]);
     
-    int  i, lostflag, index = 0;
-    char tmpbuf[128] = {0};
+    int  index = 0;
 
     ikcpcb *kcp = ikcp_create(0x01, (void*)&to);
-    kcp->output = udp_output;
+    if ((gFecEnc != NULL) || (gAead != NULL) || (gLz4 != NULL))
+    {
+        // fec, compression and encryption work on whole datagrams, keep their headers within 1400
+        int mtu = 1400;
+        if (gFecEnc != NULL)
+        {
+            mtu -= KcpFecEncoder::OVERHEAD;
+        }
+        if (gLz4 != NULL)
+        {
+            mtu -= KcpCompressor::HEADER_SIZE;
+        }
+        if (gAead != NULL)
+        {
+            mtu -= KcpAead::OVERHEAD;
+            ikcp_reserve(kcp, KcpAead::HEADER_SIZE, KcpAead::TAG_SIZE);
+        }
+        kcp->output = udp_output;
+        ikcp_setmtu(kcp, mtu);
+    }
+    else
+    {
+        kcp->outputv = udp_outputv;
+    }
     //ikcp_wndsize(kcp, 32, 32);
     ikcp_nodelay(kcp, 1, 10, 2, 1); // ģʽ 0-RTO100ms  10ms-ִм  2_ش  1-ر
     //ikcp_nodelay(kcp, 0, 10, 0 ,0); // Ĭģʽ
     
     uint64_t timeNow = GetCurrTimeAsLong(); // ms
-    ikcp_update(kcp,  timeNow);
-    ikcp_send(kcp, body, dataLen+1);
+
+    // only due sessions get ikcp_update, at the time ikcp_check asks for
+    KcpTimerWheel wheel((IUINT32)timeNow);
+    KcpTimerWheel::Handle handle;
+    wheel.Add(handle, kcp);
+    sessions[kcp->conv] = &handle;
+
+    wheel.Send(handle, body, dataLen+1);
 
     uint64_t lastSendtime = timeNow;
+    uint64_t fecIdleSince = timeNow;
 
     while (gRun)
     {
     	timeNow = GetCurrTimeAsLong();
-		ikcp_update(kcp,  timeNow);
+		wheel.Run((IUINT32)timeNow);
+
+        if (sock.WaitInput(wheel.NextTimeout((IUINT32)timeNow, 10)))
+        {
+            udp_drain(ring, sessions, wheel, to, index);
+        }
 
-	
-        recvflag = sock.WaitInput(10);
-        if (recvflag)
+        // close a group left partly filled for a while, so the last
+        // datagrams of a burst are covered without a parity per loop
+        if (gFecEnc != NULL)
         {
-            recvDataLen = sock.Recv(buf, 128, from);
-            AppLog(LOG_BASE, "--- sock.Recv len:%d  from:%s  timeNow:%05lu\n", recvDataLen, from.ToString().data(), timeNow%100000);
-            if (recvDataLen > 0)
+            if (gFecEnc->GetPending() == 0)
             {
-                if (from != to)
-                {
-                    to = from;
-                    AppLog(LOG_BASE, "chang dst addr to %s\n",to.ToString().data());
-                }
-
-                // ģ綪
-                lostflag = 0;
-                for (i=0; i<recvDataLen-2; i++)
-                {
-                    if (buf[i]==0x39 && buf[i+1]==0x38 && buf[i+2]==0x00)
-                        break;
-                }
-                if (i<recvDataLen-2)
-                {
-                    memcpy(tmpbuf, buf+i, 3);
-                    //lostflag = 1;
-                }
-                ++index;
-                if (index%4 == 0)
-                    lostflag = 1;
-
-                if (lostflag == 0)
-                    ikcp_input(kcp, buf, recvDataLen);
-                else
-                    AppLog(LOG_BASE, "*** lost packet:%d   buf:%s  timeNow:%05lu\n", index, tmpbuf, timeNow%100000);
+                fecIdleSince = timeNow;
+            }
+            else if (timeNow - fecIdleSince >= FEC_FLUSH_WAIT)
+            {
+                gFecEnc->Flush(fec_output, &to);
+                fecIdleSince = timeNow;
             }
         }
 
         timeNow = GetCurrTimeAsLong();
-        recvDataLen = ikcp_recv(kcp, buf, 128);
+        recvDataLen = ikcp_recvmsg(kcp, &msg);
         if (recvDataLen > 0)
         {
-            AppLog(LOG_BASE, "=== ikcp_recv len:%d  data:[%s]  timeNow:%05lu\n", recvDataLen, buf, timeNow%100000);
+            // messages of any size are lent in place, print the first fragment
+            int segs = ikcp_msg_views(&msg, &view, 1);
+            AppLog(LOG_BASE, "=== ikcp_recvmsg len:%d  segs:%d  data:[%.*s]  timeNow:%05lu\n", recvDataLen, segs, view.len, view.base, timeNow%100000);
+        }
+        if (recvDataLen >= 0)
+        {
+            ikcp_msg_release(&msg);
         }
 
         if ((index>0) && (timeNow-lastSendtime) >= 20)
@@ -158,7 +456,7 @@ int main(int argc,char *argv[])
             if ((--sendTimes) > 0)
             {
                 dataLen = sprintf(body, "%d hello world-%d", localport, sendTimes);          
-                ikcp_send(kcp, body, dataLen+1);
+                wheel.Send(handle, body, dataLen+1);
                 AppLog(LOG_BASE, "&&& ikcp_send  len:%d  sendTimes:%d\n", dataLen, sendTimes);
             }
         }
@@ -166,8 +464,13 @@ int main(int argc,char *argv[])
         //usleep(5*1000); 
     }
 
+    wheel.Remove(handle);
     ikcp_release(kcp);
     sock.Close();
+    delete gFecEnc;
+    delete gFecDec;
+    delete gAead;
+    delete gLz4;
     
     AppLog(LOG_BASE, "kcpclient over\n");
     return 0;
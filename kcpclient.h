@@ -9,6 +9,11 @@
 
 #include "ikcp.h"
 #include "Socket.h"
+#include "KcpTimer.h"
+#include "KcpFec.h"
+#include "KcpCrypt.h"
+#include "KcpCompress.h"
+#include "KcpEngine.h"
 
 
 